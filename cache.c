@@ -0,0 +1,142 @@
+#if defined(__unix__) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+#include "stdz.h"
+#include "cache.h"
+#include <inttypes.h>
+#if defined(_WIN32)
+#include <direct.h>
+#define mkdir(path, mode) _mkdir(path)
+#elif defined(__unix__)
+#include <sys/stat.h>
+#endif
+
+#define CACHE_MAGIC "nuvotool-cache 1"
+
+// $XDG_CACHE_HOME/nuvotool or similar
+static char* cache_dir(void)
+{
+    char* dir;
+#if defined(_WIN32)
+    const char* root = getenv("LOCALAPPDATA");
+    if (root == NULL)
+        return NULL;
+    z_asprintf(&dir, "%s\\nuvotool", root);
+#else
+    const char* root = getenv("XDG_CACHE_HOME");
+    if (root != NULL && *root != 0) {
+        mkdir(root, 0755);
+        z_asprintf(&dir, "%s/nuvotool", root);
+    } else if ((root = getenv("HOME")) != NULL) {
+        z_asprintf(&dir, "%s/.cache", root);
+        mkdir(dir, 0755);
+        free(dir);
+        z_asprintf(&dir, "%s/.cache/nuvotool", root);
+    } else
+        return NULL;
+#endif
+    mkdir(dir, 0755);
+    return dir;
+}
+
+void cache_open(CACHE* cache, const char* port, uint32_t did, size_t psz, size_t fsz)
+{
+    cache->did = did;
+    cache->psz = psz;
+    cache->pages = fsz / psz;
+    cache->hash = (uint64_t*)z_malloc(cache->pages * sizeof(uint64_t));
+    memset(cache->hash, 0, cache->pages * sizeof(uint64_t));
+    cache->path = NULL;
+
+    char* dir = cache_dir();
+    if (dir == NULL)
+        return;
+
+    // /dev/ttyUSB0 => 3650-dev_ttyUSB0
+    char* name = z_strdup(port != NULL ? port : "default");
+    for (char* p = name; *p != 0; ++p)
+        if (!isalnum((unsigned char)*p) && *p != '.' && *p != '-')
+            *p = '_';
+    z_asprintf(&cache->path, "%s/%04x-%s", dir, did,
+        (name[0] == '_') ? &name[1] : name);
+    free(name);
+    free(dir);
+
+    FILE* f = fopen(cache->path, "r");
+    if (f == NULL)
+        return;
+
+    // the same device and geometry only
+    char line[64];
+    unsigned did2;
+    size_t psz2, pages2;
+    if (fgets(line, sizeof(line), f) != NULL
+        && sscanf(line, CACHE_MAGIC " %x %zu %zu", &did2, &psz2, &pages2) == 3
+        && did2 == did && psz2 == psz && pages2 == cache->pages) {
+        size_t page;
+        uint64_t hash;
+        while (fscanf(f, "%zu %" SCNx64, &page, &hash) == 2)
+            if (page < cache->pages)
+                cache->hash[page] = hash;
+    }
+    fclose(f);
+}
+
+bool cache_save(const CACHE* cache)
+{
+    if (cache->path == NULL)
+        return false;
+
+    size_t known = 0;
+    for (size_t i = 0; i < cache->pages; ++i)
+        known += (cache->hash[i] != 0);
+    if (known == 0)
+        return remove(cache->path) == 0 || errno == ENOENT;
+
+    // write aside and rename, so a crash leaves either old or new cache
+    char* tmp;
+    z_asprintf(&tmp, "%s.tmp", cache->path);
+    FILE* f = fopen(tmp, "w");
+    if (f == NULL) {
+        free(tmp);
+        return false;
+    }
+    fprintf(f, CACHE_MAGIC " %x %zu %zu\n", (unsigned)cache->did, cache->psz,
+        cache->pages);
+    for (size_t i = 0; i < cache->pages; ++i)
+        if (cache->hash[i] != 0)
+            fprintf(f, "%zu %016" PRIx64 "\n", i, cache->hash[i]);
+    bool ok = (fflush(f) == 0);
+    ok = (fclose(f) == 0) && ok;
+#if defined(_WIN32)
+    // rename() does not replace existing file
+    if (ok)
+        remove(cache->path);
+#endif
+    ok = ok && rename(tmp, cache->path) == 0;
+    if (!ok)
+        remove(tmp);
+    free(tmp);
+    return ok;
+}
+
+void cache_close(CACHE* cache)
+{
+    free(cache->path);
+    free(cache->hash);
+    cache->path = NULL;
+    cache->hash = NULL;
+    cache->pages = 0;
+}
+
+// FNV-1a over address, size and data
+uint64_t cache_hash(size_t address, const uint8_t* data, size_t sz)
+{
+    uint64_t hash = UINT64_C(0xcbf29ce484222325);
+    uint32_t head[2] = { (uint32_t)address, (uint32_t)sz };
+    for (size_t i = 0; i < sizeof(head); ++i)
+        hash = (hash ^ ((const uint8_t*)head)[i]) * UINT64_C(0x100000001b3);
+    for (size_t i = 0; i < sz; ++i)
+        hash = (hash ^ data[i]) * UINT64_C(0x100000001b3);
+    return hash ? hash : 1;
+}
@@ -0,0 +1,41 @@
+#if !defined(CACHE_H)
+#define CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+// page hashes of the last image written to device on port
+typedef struct {
+    char* path;
+    uint32_t did;
+    size_t psz, pages;
+    uint64_t* hash;     // 0 if unknown
+} CACHE;
+
+// load cache for device on port (all pages unknown if none)
+void cache_open(CACHE* cache, const char* port, uint32_t did, size_t psz, size_t fsz);
+// CACHE cache;
+// cache_open(&cache, "/dev/ttyUSB0", did, psz, fsz);
+// ... update cache.hash[address / psz] ...
+// cache_save(&cache);
+// cache_close(&cache);
+
+// write cache file, remove it if all pages are unknown
+bool cache_save(const CACHE* cache);
+
+// free memory
+void cache_close(CACHE* cache);
+
+// hash of data at address
+uint64_t cache_hash(size_t address, const uint8_t* data, size_t sz);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif // CACHE_H
@@ -1,5 +1,12 @@
+#if defined(__unix__) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
 #include "ihx.h"
 #include "stdz.h"
+#if defined(__unix__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 
 #define MIN_BYTES   5
 #define MAX_BYTES   (MIN_BYTES + 255)
@@ -11,7 +18,7 @@ typedef struct {
     unsigned count;
     size_t address;
     int type;
-    uint8_t data[255];
+    uint8_t data[255];  // all but most of DATA records
 } CHUNK;
 
 static int char2hex(int c)
@@ -41,19 +48,204 @@ static unsigned sum8(unsigned word)
     return (word >> 8) + word;
 }
 
-// parse one record
+// convert n hex pairs to bytes, add them to sum
+// reference implementation
+static bool decode_scalar(uint8_t* dst, const char* src, size_t n, uint8_t* sum)
+{
+    for (size_t i = 0; i < n; ++i) {
+        int high = char2hex(src[2 * i]);
+        int low = char2hex(src[2 * i + 1]);
+        if (high < 0 || low < 0)
+            return false;
+        dst[i] = (high << 4) | low;
+        *sum += dst[i];
+    }
+    return true;
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+
+// 16 hex digits => 8 bytes at a time
+__attribute__((target("sse2")))
+static bool decode_sse2(uint8_t* dst, const char* src, size_t n, uint8_t* sum)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc = zero;
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128i c = _mm_loadu_si128((const __m128i*)&src[2 * i]);
+        // '0'..'9' => 0..9, 'A'..'F' and 'a'..'f' => 0..5
+        __m128i d = _mm_sub_epi8(c, _mm_set1_epi8('0'));
+        __m128i a = _mm_sub_epi8(_mm_or_si128(c, _mm_set1_epi8(0x20)),
+            _mm_set1_epi8('a'));
+        __m128i dm = _mm_and_si128(_mm_cmpgt_epi8(d, _mm_set1_epi8(-1)),
+            _mm_cmpgt_epi8(_mm_set1_epi8(10), d));
+        __m128i am = _mm_and_si128(_mm_cmpgt_epi8(a, _mm_set1_epi8(-1)),
+            _mm_cmpgt_epi8(_mm_set1_epi8(6), a));
+        if (_mm_movemask_epi8(_mm_or_si128(dm, am)) != 0xffff)
+            return false;
+        __m128i nib = _mm_or_si128(_mm_and_si128(dm, d),
+            _mm_and_si128(am, _mm_add_epi8(a, _mm_set1_epi8(10))));
+        // high nibble in even byte, low nibble in odd byte
+        __m128i w = _mm_or_si128(_mm_and_si128(_mm_slli_epi16(nib, 4),
+            _mm_set1_epi16(0xf0)), _mm_srli_epi16(nib, 8));
+        __m128i b = _mm_packus_epi16(w, zero);
+        _mm_storel_epi64((__m128i*)&dst[i], b);
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(b, zero));
+    }
+    *sum += (uint8_t)_mm_cvtsi128_si32(acc);
+    return decode_scalar(&dst[i], &src[2 * i], n - i, sum);
+}
+
+// 32 hex digits => 16 bytes at a time
+__attribute__((target("avx2")))
+static bool decode_avx2(uint8_t* dst, const char* src, size_t n, uint8_t* sum)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    __m128i acc = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256i c = _mm256_loadu_si256((const __m256i*)&src[2 * i]);
+        __m256i d = _mm256_sub_epi8(c, _mm256_set1_epi8('0'));
+        __m256i a = _mm256_sub_epi8(_mm256_or_si256(c, _mm256_set1_epi8(0x20)),
+            _mm256_set1_epi8('a'));
+        __m256i dm = _mm256_and_si256(_mm256_cmpgt_epi8(d, _mm256_set1_epi8(-1)),
+            _mm256_cmpgt_epi8(_mm256_set1_epi8(10), d));
+        __m256i am = _mm256_and_si256(_mm256_cmpgt_epi8(a, _mm256_set1_epi8(-1)),
+            _mm256_cmpgt_epi8(_mm256_set1_epi8(6), a));
+        if (_mm256_movemask_epi8(_mm256_or_si256(dm, am)) != -1)
+            return false;
+        __m256i nib = _mm256_or_si256(_mm256_and_si256(dm, d),
+            _mm256_and_si256(am, _mm256_add_epi8(a, _mm256_set1_epi8(10))));
+        __m256i w = _mm256_or_si256(_mm256_and_si256(_mm256_slli_epi16(nib, 4),
+            _mm256_set1_epi16(0xf0)), _mm256_srli_epi16(nib, 8));
+        // packus works within 128-bit lanes, gather qwords 0 and 2
+        __m256i b = _mm256_permute4x64_epi64(_mm256_packus_epi16(w, zero), 0x08);
+        __m128i lo = _mm256_castsi256_si128(b);
+        _mm_storeu_si128((__m128i*)&dst[i], lo);
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(lo, _mm_setzero_si128()));
+    }
+    acc = _mm_add_epi64(acc, _mm_unpackhi_epi64(acc, acc));
+    *sum += (uint8_t)_mm_cvtsi128_si32(acc);
+    return decode_sse2(&dst[i], &src[2 * i], n - i, sum);
+}
+
+// pick the best kernel
+static bool decode_init(uint8_t* dst, const char* src, size_t n, uint8_t* sum);
+static bool (*decode)(uint8_t*, const char*, size_t, uint8_t*) = decode_init;
+
+static void decode_select(void)
+{
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        decode = decode_avx2;
+    else if (__builtin_cpu_supports("sse2"))
+        decode = decode_sse2;
+    else
+        decode = decode_scalar;
+}
+
+static bool decode_init(uint8_t* dst, const char* src, size_t n, uint8_t* sum)
+{
+    decode_select();
+    return decode(dst, src, n, sum);
+}
+#else
+#define decode decode_scalar
+#define decode_select() ((void)0)
+#endif // __GNUC__ && x86
+
+size_t ihx_decoders(IHX_DECODER decoders[IHX_MAX_DECODERS])
+{
+    size_t n = 0;
+    decoders[n++] = decode_scalar;
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2"))
+        decoders[n++] = decode_sse2;
+    if (__builtin_cpu_supports("avx2"))
+        decoders[n++] = decode_avx2;
+#endif
+    return n;
+}
+
+// sparse image in 64 KB blocks, allocated on first write
+typedef struct {
+    size_t address;         // 64 KB aligned
+    uint8_t* data;
+} BLOCK;
+
+typedef struct {
+    BLOCK* block;           // sorted
+    size_t blocks, capacity, hit;
+} BLOCKS;
+
+// pointer to address, add block if missing
+static uint8_t* block_at(BLOCKS* bs, size_t address)
+{
+    size_t key = address & ~(size_t)0xffff;
+    size_t lo = bs->hit;
+    if (lo >= bs->blocks || bs->block[lo].address != key) {
+        // binary search
+        size_t hi = bs->blocks;
+        for (lo = 0; lo < hi; ) {
+            size_t mid = lo + (hi - lo) / 2;
+            if (bs->block[mid].address < key)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        if (lo == bs->blocks || bs->block[lo].address != key) {
+            if (bs->blocks >= bs->capacity) {
+                bs->capacity = bs->capacity * 2 + 16;
+                bs->block = (BLOCK*)z_realloc(bs->block, bs->capacity * sizeof(BLOCK));
+            }
+            memmove(&bs->block[lo + 1], &bs->block[lo],
+                (bs->blocks - lo) * sizeof(BLOCK));
+            bs->block[lo].address = key;
+            bs->block[lo].data = (uint8_t*)z_malloc(0x10000);
+            ++bs->blocks;
+        }
+        bs->hit = lo;
+    }
+    return bs->block[lo].data + (address & 0xffff);
+}
+
+// copy sz bytes from or to blocks at address
+static void block_copy(BLOCKS* bs, size_t address, uint8_t* data, size_t sz,
+    bool to_blocks)
+{
+    for (size_t done = 0, part; done < sz; done += part) {
+        size_t at = address + done;
+        part = min(sz - done, 0x10000 - (at & 0xffff));
+        if (to_blocks)
+            memcpy(block_at(bs, at), &data[done], part);
+        else
+            memcpy(&data[done], block_at(bs, at), part);
+    }
+}
+
+static void block_free(BLOCKS* bs)
+{
+    for (size_t i = 0; i < bs->blocks; ++i)
+        free(bs->block[i].data);
+    free(bs->block);
+}
+
+// parse one record of length characters (no LF)
+// DATA goes straight to blocks at segment + address, the rest to pc->data
+// (all to pc->data if bs is NULL)
 // return record type or -1
-static int parse_record(CHUNK* pc, const char* line)
+static int parse_record(CHUNK* pc, const char* line, size_t length, BLOCKS* bs,
+    size_t segment)
 {
     // init chunk
     pc->count = 0;
     pc->address = 0;
     pc->type = -1;
 
-    // cut newline character
-    unsigned length = strlen(line);
-    if (length > 0 && line[length - 1] == '\n')
-        --length;
+    // cut CR
     if (length > 0 && line[length - 1] == '\r')
         --length;
 
@@ -68,66 +260,567 @@ static int parse_record(CHUNK* pc, const char* line)
     if (length < MIN_LINE || length > MAX_LINE || !(length & 1))
         return -1;
 
-    // convert line to byte array
-    uint8_t blob[MAX_BYTES];
-    size_t bloblen = 0;
-    for (size_t i = 1; bloblen < MAX_BYTES; i += 2) {
-        int high = char2hex(line[i]);
-        if (high < 0)
-            break;
-        int low = char2hex(line[i + 1]);
-        if (low < 0)
-            break;
-        blob[bloblen++] = (high << 4) | low;
-    }
-    if (bloblen != (length - 1) / 2)
-        return -1;
-
     // get count, address and type
-    unsigned count = blob[0];
-    unsigned address = make16(blob[1], blob[2]);
-    unsigned type = blob[3];
-    if (count != bloblen - MIN_BYTES || address + count > 0x10000)
+    uint8_t head[4], sum = 0;
+    if (!decode(head, &line[1], sizeof(head), &sum))
+        return -1;
+    unsigned count = head[0];
+    unsigned address = make16(head[1], head[2]);
+    unsigned type = head[3];
+    if (length != MIN_LINE + 2 * count || address + count > 0x10000)
         return -1;
 
-    // verify checksum
-    uint8_t sum = 0;
-    for (size_t i = 0; i < bloblen; ++i)
-        sum += blob[i];
-    if (sum != 0)
+    // decode data and verify checksum
+    // DATA crossing 64 KB block boundary (CS records only) is copied afterwards
+    size_t at = segment + address;
+    bool direct = (bs != NULL && type == 0 && count > 0
+        && (at & 0xffff) + count <= 0x10000);
+    uint8_t* data = direct ? block_at(bs, at) : pc->data;
+    uint8_t checksum;
+    if (!decode(data, &line[9], count, &sum)
+        || !decode(&checksum, &line[9 + 2 * count], 1, &sum) || sum != 0)
         return -1;
+    if (bs != NULL && type == 0 && !direct)
+        block_copy(bs, at, pc->data, count, true);
 
     pc->count = count;
     pc->address = address;
     pc->type = type;
-    memcpy(pc->data, &blob[4], count);
     return pc->type;
 }
 
-// convert Intel HEX to Binary image
-int ihx_load(IHX* ihx, unsigned filler, FILE* f)
+// whole input in memory
+typedef struct {
+    const char* text;
+    size_t sz;
+    char* buf;          // malloc'ed unless mapped
+} INPUT;
+
+// map regular file, read anything else
+static void input_open(INPUT* in, FILE* f)
 {
-    size_t segment = 0, blocksize = 0x10000;    // 64 KB
-    size_t start = SIZE_MAX, end = 0, eip = 0;
+#if defined(__unix__)
+    struct stat st;
+    int fd = fileno(f);
+    if (fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            posix_madvise(map, st.st_size, POSIX_MADV_SEQUENTIAL);
+            in->text = (const char*)map;
+            in->sz = st.st_size;
+            in->buf = NULL;
+            return;
+        }
+    }
+#endif // __unix__
 
-    ihx->image = (uint8_t*)memset(z_malloc(blocksize), min(filler, 255), blocksize);
-    ihx->sz = ihx->base = ihx->entry = 0;
+    size_t capacity = 0x10000;
+    in->buf = (char*)z_malloc(capacity);
+    in->sz = 0;
+    for (size_t part; (part = fread(in->buf + in->sz, 1, capacity - in->sz, f)) > 0; ) {
+        in->sz += part;
+        if (in->sz == capacity) {
+            capacity *= 2;
+            in->buf = (char*)z_realloc(in->buf, capacity);
+        }
+    }
+    in->text = in->buf;
+}
 
-    bool found_eof = false;
-    do {
-        char line[MAX_LINE + 3];    // CR+LF+NUL
-        if (fgets(line, sizeof(line), f) == NULL)
-            break;
+static void input_close(INPUT* in)
+{
+#if defined(__unix__)
+    if (in->buf == NULL) {
+        munmap((void*)in->text, in->sz);
+        return;
+    }
+#endif // __unix__
+    free(in->buf);
+}
+
+// append extent, merge with the last one if adjacent
+static void add_extent(IHX* ihx, size_t* capacity, size_t address, size_t sz)
+{
+    if (ihx->extents > 0) {
+        IHX_EXTENT* last = &ihx->extent[ihx->extents - 1];
+        if (last->address + last->sz == address) {
+            last->sz += sz;
+            return;
+        }
+    }
+    if (ihx->extents >= *capacity) {
+        *capacity = *capacity * 2 + 16;
+        ihx->extent = (IHX_EXTENT*)z_realloc(ihx->extent,
+            *capacity * sizeof(IHX_EXTENT));
+    }
+    ihx->extent[ihx->extents].address = address;
+    ihx->extent[ihx->extents].sz = sz;
+    ihx->extent[ihx->extents++].data = NULL;
+}
+
+static int cmp_extent(const void* p1, const void* p2)
+{
+    size_t a1 = ((const IHX_EXTENT*)p1)->address;
+    size_t a2 = ((const IHX_EXTENT*)p2)->address;
+    return (a1 > a2) - (a1 < a2);
+}
+
+// sort extents, merge overlapping and adjacent ones
+static void merge_extents(IHX* ihx)
+{
+    if (ihx->extents == 0)
+        return;
+
+    qsort(ihx->extent, ihx->extents, sizeof(IHX_EXTENT), cmp_extent);
+    size_t n = 0;
+    for (size_t i = 1; i < ihx->extents; ++i) {
+        IHX_EXTENT* last = &ihx->extent[n];
+        size_t end = ihx->extent[i].address + ihx->extent[i].sz;
+        if (ihx->extent[i].address <= last->address + last->sz)
+            last->sz = max(last->address + last->sz, end) - last->address;
+        else
+            ihx->extent[++n] = ihx->extent[i];
+    }
+    ihx->extents = n + 1;
+    ihx->extent = (IHX_EXTENT*)z_realloc(ihx->extent,
+        ihx->extents * sizeof(IHX_EXTENT));
+}
+
+// parser state for a range of text
+typedef struct {
+    const char* text;
+    const char* eot;
+    BLOCKS blocks;
+    IHX ihx;                // extents only
+    size_t capacity;
+    size_t segment, start, end, eip;
+    bool found_eof, error;
+} PARSE;
+
+static void parse_init(PARSE* ps, const char* text, const char* eot)
+{
+    memset(ps, 0, sizeof(PARSE));
+    ps->text = text;
+    ps->eot = eot;
+    ps->start = SIZE_MAX;
+    ps->eip = SIZE_MAX;
+}
+
+// parse records until EOF record, error or end of text
+static void parse_range(PARSE* ps)
+{
+    for (const char* p = ps->text; p < ps->eot && !ps->found_eof; ) {
+        const char* eol = (const char*)memchr(p, '\n', ps->eot - p);
+        if (eol == NULL)
+            eol = ps->eot;
 
         CHUNK chunk;
-        switch (parse_record(&chunk, line)) {
+        switch (parse_record(&chunk, p, eol - p, &ps->blocks, ps->segment)) {
         case 0: /* DATA */
             if (chunk.count > 0) {
-                // parse_record() guarantees never getting past 64 KB
-                memcpy(ihx->image + segment + chunk.address, chunk.data, chunk.count);
-                start = min(start, segment + chunk.address);
-                end = max(end, segment + chunk.address + chunk.count);
+                size_t address = ps->segment + chunk.address;
+                ps->start = min(ps->start, address);
+                ps->end = max(ps->end, address + chunk.count);
+                add_extent(&ps->ihx, &ps->capacity, address, chunk.count);
+            }
+        break;
+        case 1: /* EOF */
+            ps->found_eof = (chunk.count == 0);
+        break;
+        case 2: /* CS */
+        case 4: /* HIWORD(ADDRESS32) */
+            if (chunk.count == 2) {
+                ps->segment = make16(chunk.data[0], chunk.data[1]);
+                ps->segment <<= (chunk.type == 2) ? 4 : 16;
+            }
+        break;
+        case 3: /* CS:IP */
+        case 5: /* EIP */
+            if (chunk.count == 4) {
+                ps->eip = make16(chunk.data[0], chunk.data[1]);
+                ps->eip <<= (chunk.type == 3) ? 4 : 16;
+                ps->eip += make16(chunk.data[2], chunk.data[3]);
+            }
+        break;
+        case -1:
+        default:
+            ps->error = true;
+        return;
+        }
+
+        p = (eol < ps->eot) ? eol + 1 : ps->eot;
+    }
+}
+
+#if defined(__unix__)
+#include <pthread.h>
+#include <unistd.h>
+
+enum {
+    IHX_PARALLEL_MIN = 0x100000,    // min text per thread, 1 MB
+    IHX_MAX_THREADS = 16,
+};
+
+// segment records of a range, without checksum (parse_range will do)
+typedef struct {
+    const char* text;
+    const char* eot;
+    const char* first;      // first segment record if any
+    size_t lo, hi;          // lowest and highest segment
+    const char* eof;        // end of EOF record if any
+} PRESCAN;
+
+static void* prescan_range(void* arg)
+{
+    PRESCAN* pre = (PRESCAN*)arg;
+    for (const char* p = pre->text; p < pre->eot; ) {
+        const char* eol = (const char*)memchr(p, '\n', pre->eot - p);
+        if (eol == NULL)
+            eol = pre->eot;
+
+        // :LLAAAATT...
+        if (eol - p >= MIN_LINE && p[0] == ':' && p[1] == '0') {
+            if (p[2] == '0' && p[7] == '0' && p[8] == '1') {
+                pre->eof = eol;
+                break;
+            }
+            uint8_t high[2], sum = 0;
+            if (p[2] == '2' && p[7] == '0' && (p[8] == '2' || p[8] == '4')
+                && eol - p >= MIN_LINE + 4 && decode_scalar(high, &p[9], 2, &sum)) {
+                size_t segment = make16(high[0], high[1]);
+                segment <<= (p[8] == '2') ? 4 : 16;
+                if (pre->first == NULL) {
+                    pre->first = p;
+                    pre->lo = pre->hi = segment;
+                }
+                pre->lo = min(pre->lo, segment);
+                pre->hi = max(pre->hi, segment);
+            }
+        }
+
+        p = (eol < pre->eot) ? eol + 1 : pre->eot;
+    }
+    return NULL;
+}
+
+static void* parse_thread(void* arg)
+{
+    parse_range((PARSE*)arg);
+    return NULL;
+}
+
+// run fn(arg[i]) for i < n, one thread each
+static void run_threads(void* (*fn)(void*), void* arg, size_t size, size_t n)
+{
+    pthread_t tid[IHX_MAX_THREADS];
+    for (size_t i = 1; i < n; ++i)
+        if (pthread_create(&tid[i], NULL, fn, (char*)arg + i * size) != 0)
+            tid[i] = pthread_self();
+    fn(arg);
+    for (size_t i = 1; i < n; ++i)
+        if (!pthread_equal(tid[i], pthread_self()))
+            pthread_join(tid[i], NULL);
+        else
+            fn((char*)arg + i * size);
+}
+
+// split text at segment records, parse ranges in parallel
+// return number of ranges, 0 to parse sequentially
+static size_t parse_parallel(PARSE* ps, const char* text, size_t sz)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t n = min(sz / IHX_PARALLEL_MIN, (size_t)IHX_MAX_THREADS);
+    n = min(n, (size_t)max(cpus, 1));
+    if (n < 2)
+        return 0;
+
+    PRESCAN pre[IHX_MAX_THREADS];
+    const char* eot = text + sz;
+    for (size_t i = 0; i < n; ++i) {
+        memset(&pre[i], 0, sizeof(PRESCAN));
+        pre[i].text = (i > 0) ? pre[i - 1].eot : text;
+        const char* p = text + sz / n * (i + 1);
+        const char* eol = (i + 1 < n && p < eot) ?
+            (const char*)memchr(p, '\n', eot - p) : NULL;
+        pre[i].eot = (eol != NULL) ? eol + 1 : eot;
+    }
+    run_threads(prescan_range, pre, sizeof(PRESCAN), n);
+
+    // each range must write to its own 64 KB windows, in ascending order,
+    // or else later records may win over earlier ones (sequential parse only)
+    size_t ranges = 0, hi = 0;
+    const char* start = text;
+    for (size_t i = 0; i < n; ++i) {
+        if (i > 0 && pre[i].first != NULL) {
+            if (hi + 0x10000 > pre[i].lo)
+                return 0;
+            parse_init(&ps[ranges++], start, pre[i].first);
+            start = pre[i].first;
+        }
+        if (pre[i].first != NULL)
+            hi = pre[i].hi;
+        if (pre[i].eof != NULL) {
+            eot = pre[i].eof;
+            break;
+        }
+    }
+    parse_init(&ps[ranges++], start, eot);
+    if (ranges < 2)
+        return 0;
+
+    decode_select();
+    run_threads(parse_thread, ps, sizeof(PARSE), ranges);
+    return ranges;
+}
+#else
+#define parse_parallel(ps, text, sz) 0
+#endif // __unix__
+
+// merged extents of all ranges, with their data
+static void gather(IHX* ihx, PARSE* ps, size_t n)
+{
+    size_t capacity = 0;
+    for (size_t r = 0; r < n; ++r) {
+        merge_extents(&ps[r].ihx);
+        for (size_t i = 0; i < ps[r].ihx.extents; ++i)
+            add_extent(ihx, &capacity, ps[r].ihx.extent[i].address,
+                ps[r].ihx.extent[i].sz);
+    }
+    merge_extents(ihx);
+
+    for (size_t i = 0; i < ihx->extents; ++i)
+        ihx->extent[i].data = (uint8_t*)z_malloc(ihx->extent[i].sz);
+    // ranges never overlap, any order will do
+    for (size_t r = 0; r < n; ++r) {
+        IHX_EXTENT* dst = ihx->extent;
+        for (size_t i = 0; i < ps[r].ihx.extents; ++i) {
+            const IHX_EXTENT* e = &ps[r].ihx.extent[i];
+            while (dst->address + dst->sz <= e->address)
+                ++dst;
+            block_copy(&ps[r].blocks, e->address, &dst->data[e->address - dst->address],
+                e->sz, false);
+        }
+    }
+}
+
+// load Intel HEX or Binary file as extents
+int ihx_load_sparse(IHX* ihx, FILE* f)
+{
+    INPUT in;
+    input_open(&in, f);
+
+#if defined(__unix__)
+    PARSE ps[IHX_MAX_THREADS];
+#else
+    PARSE ps[1];
+#endif // __unix__
+    size_t n = parse_parallel(ps, in.text, in.sz);
+    if (n == 0) {
+        parse_init(&ps[0], in.text, in.text + in.sz);
+        parse_range(&ps[0]);
+        n = 1;
+    }
+
+    bool error = false;
+    size_t start = SIZE_MAX, end = 0, eip = SIZE_MAX;
+    for (size_t r = 0; r < n; ++r) {
+        error |= ps[r].error;
+        start = min(start, ps[r].start);
+        end = max(end, ps[r].end);
+        if (ps[r].eip != SIZE_MAX)
+            eip = ps[r].eip;
+    }
+
+    memset(ihx, 0, sizeof(IHX));
+    if (!error)
+        gather(ihx, ps, n);
+    for (size_t r = 0; r < n; ++r) {
+        free(ps[r].ihx.extent);
+        block_free(&ps[r].blocks);
+    }
+
+    if (error) {
+        // assume Binary file
+        ihx->extent = (IHX_EXTENT*)z_malloc(sizeof(IHX_EXTENT));
+        ihx->extent[0].address = 0;
+        ihx->extent[0].sz = ihx->sz = in.sz;
+        if (in.buf != NULL) {
+            // take over read buffer
+            ihx->extent[0].data = (uint8_t*)z_realloc(in.buf, in.sz);
+            in.buf = NULL;
+        } else {
+            ihx->extent[0].data = (uint8_t*)memcpy(z_malloc(in.sz), in.text, in.sz);
+            input_close(&in);
+        }
+        ihx->extents = 1;
+        return 'b';
+    }
+    input_close(&in);
+
+    if (start < end) {
+        ihx->sz = end - start;
+        ihx->base = start;
+        ihx->entry = (start <= eip && eip < end) ? eip : start;
+    }
+    return 'x';
+}
+
+// make image of extents
+bool ihx_flatten(IHX* ihx, unsigned filler, size_t limit)
+{
+    if (ihx->image != NULL || ihx->extents == 0)
+        return true;
+
+    // nothing to fill in
+    if (ihx->extents == 1) {
+        ihx->image = ihx->extent[0].data;
+        return true;
+    }
+
+    if (ihx->sz > limit) {
+        errno = EFBIG;
+        return false;
+    }
+
+    ihx->image = (uint8_t*)memset(z_malloc(ihx->sz), min(filler, 255), ihx->sz);
+    for (size_t i = 0; i < ihx->extents; ++i) {
+        IHX_EXTENT* e = &ihx->extent[i];
+        uint8_t* data = &ihx->image[e->address - ihx->base];
+        memcpy(data, e->data, e->sz);
+        free(e->data);
+        e->data = data;
+    }
+    return true;
+}
+
+void ihx_free(IHX* ihx)
+{
+    if (ihx->image == NULL)
+        for (size_t i = 0; i < ihx->extents; ++i)
+            free(ihx->extent[i].data);
+    free(ihx->image);
+    free(ihx->extent);
+    memset(ihx, 0, sizeof(IHX));
+}
+
+// convert Intel HEX to Binary image
+int ihx_load(IHX* ihx, unsigned filler, FILE* f)
+{
+    int fmt = ihx_load_sparse(ihx, f);
+    if (fmt >= 0 && !ihx_flatten(ihx, filler, IHX_FLAT_LIMIT)) {
+        int errnum = errno;
+        ihx_free(ihx);
+        errno = errnum;
+        return -1;
+    }
+    return fmt;
+}
+
+// pages not yet passed to stream
+typedef struct {
+    IHX_STREAM* st;
+    uint8_t* buf;
+    bool* used;
+    size_t npages;
+    size_t address;         // of buf[0], page aligned
+    size_t start, end;
+} WINDOW;
+
+// pass used pages below address, move window up
+static bool window_flush(WINDOW* w, size_t address)
+{
+    size_t psz = w->st->psz;
+    address &= ~(psz - 1);
+    size_t n = min((address - w->address) / psz, w->npages);
+    for (size_t i = 0; i < n; ++i)
+        if (w->used[i]
+            && !w->st->page(w->st->ctx, w->address + i * psz, &w->buf[i * psz]))
+            return false;
+
+    size_t keep = w->npages - n;
+    memmove(w->buf, &w->buf[n * psz], keep * psz);
+    memmove(w->used, &w->used[n], keep * sizeof(bool));
+    memset(&w->buf[keep * psz], min(w->st->filler, 255), n * psz);
+    memset(&w->used[keep], 0, n * sizeof(bool));
+    w->address = address;
+    return true;
+}
+
+// put bytes, pass all pages below
+static bool window_put(WINDOW* w, size_t address, const uint8_t* data, size_t sz)
+{
+    if (address < w->address) {
+        errno = EILSEQ;     // page passed already
+        return false;
+    }
+    if (!window_flush(w, address))
+        return false;
+
+    size_t psz = w->st->psz;
+    for (size_t done = 0, part; done < sz; done += part) {
+        size_t offset = address + done - w->address;
+        if (offset >= w->npages * psz) {
+            if (!window_flush(w, address + done))
+                return false;
+            offset = address + done - w->address;
+        }
+        part = min(sz - done, w->npages * psz - offset);
+        memcpy(&w->buf[offset], &data[done], part);
+        for (size_t i = offset / psz; i <= (offset + part - 1) / psz; ++i)
+            w->used[i] = true;
+    }
+
+    w->start = min(w->start, address);
+    w->end = max(w->end, address + sz);
+    return true;
+}
+
+// read Intel HEX or Binary file, pass pages as soon as complete
+int ihx_stream(IHX_STREAM* st, FILE* f)
+{
+    WINDOW w = {
+        .st = st,
+        .npages = 2 + 256 / st->psz,    // room for the longest record
+        .start = SIZE_MAX,
+    };
+    w.buf = (uint8_t*)memset(z_malloc(w.npages * st->psz), min(st->filler, 255),
+        w.npages * st->psz);
+    w.used = (bool*)z_malloc(w.npages * sizeof(bool));
+    memset(w.used, 0, w.npages * sizeof(bool));
+
+    enum { BUFSIZE = 0x10000 };
+    char* text = (char*)z_malloc(BUFSIZE);
+    size_t len = 0, pos = 0, segment = 0, eip = SIZE_MAX;
+    bool at_start = true, eof = false, found_eof = false, ok = true;
+    int fmt = 'x';
+
+    while (ok && !found_eof) {
+        char* eol = (char*)memchr(&text[pos], '\n', len - pos);
+        if (eol == NULL) {
+            if (eof && pos >= len)
+                break;
+            if (!eof) {
+                // keep partial line, read more
+                if (pos > 0) {
+                    memmove(text, &text[pos], len - pos);
+                    len -= pos;
+                    pos = 0;
+                    at_start = false;
+                }
+                size_t part = (len < BUFSIZE) ?
+                    fread(&text[len], 1, BUFSIZE - len, f) : 0;
+                len += part;
+                eof = (part == 0);
+                continue;
             }
+            eol = &text[len];   // last line without LF
+        }
+
+        CHUNK chunk;
+        switch (parse_record(&chunk, &text[pos], eol - &text[pos], NULL, segment)) {
+        case 0: /* DATA */
+            if (chunk.count > 0)
+                ok = window_put(&w, segment + chunk.address, chunk.data, chunk.count);
         break;
         case 1: /* EOF */
             found_eof = (chunk.count == 0);
@@ -137,14 +830,6 @@ int ihx_load(IHX* ihx, unsigned filler, FILE* f)
             if (chunk.count == 2) {
                 segment = make16(chunk.data[0], chunk.data[1]);
                 segment <<= (chunk.type == 2) ? 4 : 16;
-                // grow image if less than 64 KB remaining
-                if (segment + 0x10000 > blocksize) {
-                    size_t newsize = segment + 0x100000; // +1 MB
-                    ihx->image = (uint8_t*)z_realloc(ihx->image, newsize);
-                    memset(ihx->image + blocksize, min(filler, 255),
-                        newsize - blocksize);
-                    blocksize = newsize;
-                }
             }
         break;
         case 3: /* CS:IP */
@@ -157,61 +842,112 @@ int ihx_load(IHX* ihx, unsigned filler, FILE* f)
         break;
         case -1:
         default:
-            // assume Binary file
-            if (fseek(f, 0, SEEK_END) == 0) {
-                long t = ftell(f);
-                if (t > 0) {
-                    fseek(f, 0, SEEK_SET);
-                    ihx->image = (uint8_t*)z_realloc(ihx->image, t);
-                    ihx->sz = fread(ihx->image, 1, t, f);
-                    return 'b';
-                }
+            // binary unless there was data already
+            if (w.start != SIZE_MAX || !at_start) {
+                errno = EILSEQ;
+                ok = false;
+                break;
+            }
+            fmt = 'b';
+            for (size_t address = 0; ok && len > 0; ) {
+                ok = window_put(&w, address, (const uint8_t*)text, len);
+                address += len;
+                len = fread(text, 1, BUFSIZE, f);
             }
-            free(ihx->image);
-            ihx->image = NULL;
-            return -1;
+            found_eof = true;
         break;
         }
-    } while (!found_eof);
 
-    if (start < end) {
-        // rebase image
-        if (start > 0)
-            memmove(ihx->image, ihx->image + start, end - start);
-        ihx->sz = end - start;
-        ihx->base = start;
-        ihx->entry = (start <= eip && eip < end) ? eip : start;
+        pos = (eol < &text[len]) ? (size_t)(eol - text) + 1 : len;
     }
 
-    // shrink memory block
-    ihx->image = (uint8_t*)z_realloc(ihx->image, ihx->sz);
-    return 'x';
+    // the rest of pages
+    if (ok && w.start < w.end)
+        ok = window_flush(&w, w.address + w.npages * st->psz);
+
+    st->base = st->sz = st->entry = 0;
+    if (w.start < w.end) {
+        st->base = w.start;
+        st->sz = w.end - w.start;
+        st->entry = (w.start <= eip && eip < w.end) ? eip : w.start;
+    }
+
+    free(text);
+    free(w.used);
+    free(w.buf);
+    return ok ? fmt : -1;
+}
+
+// buffered output of records
+typedef struct {
+    char buf[0x8000];
+    size_t len;
+    FILE* f;
+} OUTPUT;
+
+// room for one more record
+static char* output_line(OUTPUT* out)
+{
+    if (out->len + MAX_LINE + 1 > sizeof(out->buf)) {
+        fwrite(out->buf, 1, out->len, out->f);
+        out->len = 0;
+    }
+    return &out->buf[out->len];
+}
+
+static const char digits[] = "0123456789ABCDEF";
+
+// value as n uppercase hex digits
+static char* put_hex(char* p, unsigned value, unsigned n)
+{
+    for (unsigned i = n; i > 0; --i, value >>= 4)
+        p[i - 1] = digits[value & 0xf];
+    return p + n;
+}
+
+// : count address type data checksum LF
+static void put_record(OUTPUT* out, unsigned type, unsigned address,
+    const uint8_t* data, unsigned count)
+{
+    char* p = output_line(out);
+    char* start = p;
+    *p++ = ':';
+    p = put_hex(p, count, 2);
+    p = put_hex(p, address, 4);
+    p = put_hex(p, type, 2);
+    int sum = count + sum8(address) + type;
+    for (unsigned i = 0; i < count; ++i) {
+        *p++ = digits[data[i] >> 4];
+        *p++ = digits[data[i] & 0xf];
+        sum += data[i];
+    }
+    p = put_hex(p, (uint8_t)(-sum), 2);
+    *p++ = '\n';
+    out->len += p - start;
 }
 
 // format output as Intel HEX file
 void ihx_dump(IHX* ihx, unsigned filler, unsigned wrap, FILE* f)
 {
     size_t segment = ihx->base & 0xffff0000;    // over 64 KB
-    bool use32 = (ihx->sz > 0x100000);          // size > 1 MB
+    bool use32 = (ihx->sz > 0x100000            // size > 1 MB
+        || ihx->base + ihx->sz > 0x100000);     // or beyond CS reach
+    OUTPUT* out = (OUTPUT*)z_malloc(sizeof(OUTPUT));
+    out->len = 0;
+    out->f = f;
 
     if (wrap == 0)
         wrap = 16;
+    wrap = min(wrap, 255);
 
     for (size_t i = 0; i < ihx->sz; ) {
         // segment overrun
         if (segment <= ihx->base + i) {
             // address output
             if (segment > 0) {
-                unsigned type, high;
-                if (use32) {
-                    type = 4;   // HIWORD(ADDRESS32)
-                    high = segment >> 16;
-                } else {
-                    type = 2;   // CS
-                    high = segment >> 4;
-                }
-                int sum = 2 + type + sum8(high);
-                fprintf(f, ":020000%02X%04X%02X\n", type, high, (uint8_t)(-sum));
+                unsigned high = use32 ? (segment >> 16) : (segment >> 4);
+                uint8_t data[2] = { (uint8_t)(high >> 8), (uint8_t)high };
+                put_record(out, use32 ? 4/*HIWORD(ADDRESS32)*/ : 2/*CS*/, 0, data, 2);
             }
             segment += 0x10000; // +64 KB
         }
@@ -228,18 +964,8 @@ void ihx_dump(IHX* ihx, unsigned filler, unsigned wrap, FILE* f)
                 if (ihx->image[i + cb_line - 1] != filler)
                     break;
 
-        if (cb_line > 0) {
-            // : count address type(00)
-            fprintf(f, ":%02X%04X00", cb_line, (uint16_t)(ihx->base + i));
-            int sum = cb_line + sum8(ihx->base + i);
-            // data
-            for (unsigned j = 0; j < cb_line; ++j) {
-                fprintf(f, "%02X", ihx->image[i + j]);
-                sum += ihx->image[i + j];
-            }
-            // checksum
-            fprintf(f, "%02X\n", (uint8_t)(-sum));
-        }
+        if (cb_line > 0)
+            put_record(out, 0, (uint16_t)(ihx->base + i), &ihx->image[i], cb_line);
 
         // advance index
         i += cb_max;
@@ -247,19 +973,14 @@ void ihx_dump(IHX* ihx, unsigned filler, unsigned wrap, FILE* f)
 
     // start address
     if (ihx->entry > 0) {
-        unsigned type, high;
-        if (use32) {
-            type = 5;
-            high = ihx->entry >> 16;
-        } else {
-            type = 3;
-            high = (ihx->entry & 0xf0000) >> 4;
-        }
-        int sum = 4 + type + sum8(high + ihx->entry);
-        fprintf(f, ":040000%02X%04X%04X%02X\n", type, high, (uint16_t)ihx->entry,
-            (uint8_t)(-sum));
+        unsigned high = use32 ? (ihx->entry >> 16) : ((ihx->entry & 0xf0000) >> 4);
+        uint8_t data[4] = { (uint8_t)(high >> 8), (uint8_t)high,
+            (uint8_t)(ihx->entry >> 8), (uint8_t)ihx->entry };
+        put_record(out, use32 ? 5/*EIP*/ : 3/*CS:IP*/, 0, data, 4);
     }
 
     // EOF record
-    fputs(":00000001FF\n", f);
+    put_record(out, 1, 0, NULL, 0);
+    fwrite(out->buf, 1, out->len, f);
+    free(out);
 }
@@ -1,6 +1,7 @@
 #if !defined(IHX_H)
 #define IHX_H
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -9,29 +10,82 @@
 extern "C" {
 #endif
 
+// address range populated by records
 typedef struct {
-    uint8_t* image;
+    size_t address, sz;
+    uint8_t* data;          // into image if flat
+} IHX_EXTENT;
+
+typedef struct {
+    uint8_t* image;         // NULL unless flat
     size_t sz, base, entry;
+    IHX_EXTENT* extent;     // sorted and merged
+    size_t extents;
 } IHX;
 
-// load Intel HEX or Binary file
-// note: may fseek(f), caller must free(image)
+enum {
+    IHX_FLAT_LIMIT = 0x1000000, // 16 MB, image size for ihx_load()
+    IHX_MAX_DECODERS = 3,       // scalar, SSE2 and AVX2
+};
+
+// convert n hex pairs to bytes, add them to sum
+// return false on bad hex digit (dst and sum are undefined then)
+typedef bool (*IHX_DECODER)(uint8_t* dst, const char* src, size_t n, uint8_t* sum);
+
+// load Intel HEX or Binary file, then flatten
+// note: reads f to the end (maps it if regular file)
+// set errno to EFBIG if image would exceed IHX_FLAT_LIMIT
 int ihx_load(IHX* ihx, unsigned filler, FILE* f);
 // IHX ihx;
 // int fmt = ihx_load(&ihx, 0xff, f);
 // if (fmt < 0) {
 //     assert(fmt == -1);
-//     assert(ihx.image == NULL);
-//     assert(ihx.sz == 0);
+//     assert(ihx.image == NULL && ihx.extent == NULL);
+//     assert(ihx.sz == 0 && ihx.extents == 0);
 //     assert(ihx.base == 0 && ihx.entry == 0);
 // } else {
 //     assert(fmt == 'x' || fmt == 'b');
-//     assert(ihx.image != NULL);
-//     assert(ihx.sz > 0);
+//     assert(ihx.image != NULL && ihx.extent != NULL);
+//     assert(ihx.sz > 0 && ihx.extents > 0);
 //     assert(ihx.base <= ihx.entry && ihx.entry < ihx.base + ihx.sz);
+//     assert(ihx.extent[0].address == ihx.base);
+//     assert(ihx.extent[0].data == ihx.image);
 // }
+// ihx_free(&ihx);
+
+// load Intel HEX or Binary file as extents, only memory touched by records
+// is allocated (image is NULL, sz spans all extents)
+int ihx_load_sparse(IHX* ihx, FILE* f);
+
+// make image of extents if sz <= limit, or else set errno to EFBIG
+// extent data is moved into image
+bool ihx_flatten(IHX* ihx, unsigned filler, size_t limit);
+
+// free memory, flat or not
+void ihx_free(IHX* ihx);
+
+// pages for ihx_stream()
+typedef struct {
+    size_t psz;             // power of 2, 256 or less
+    unsigned filler;        // unused bytes of page
+    bool (*page)(void* ctx, size_t address, const uint8_t* data);
+    void* ctx;
+    // results
+    size_t base, sz, entry;
+} IHX_STREAM;
+
+// read Intel HEX or Binary file in bounded memory, call page() for each page
+// as soon as it is complete, in ascending order
+// HEX records may not go back to pages passed already (errno is EILSEQ then),
+// a bad record is Binary file only if no data came before it
+// return -1 if page() returns false
+int ihx_stream(IHX_STREAM* st, FILE* f);
+
+// get hex decoders this CPU can run, scalar reference one goes first
+// return their number, IHX_MAX_DECODERS at most
+size_t ihx_decoders(IHX_DECODER decoders[IHX_MAX_DECODERS]);
 
-// format output as Intel HEX file
+// format output as Intel HEX file, image must be flat
 // if filler <= 255 then may skip consecutive "filler" bytes
 // if wrap == 0 then use default value (16)
 void ihx_dump(IHX* ihx, unsigned filler, unsigned wrap, FILE* f);
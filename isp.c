@@ -3,70 +3,361 @@
 #include "bswap.h"
 #include "ucomm.h"
 
-// Nuvoton ISP: send one command and read response
-bool isp_command(uint32_t code, void* data, intptr_t fd)
-{
-    static uint32_t packno = 1;
+typedef union {
+    uint8_t raw[ISP_PACKET_SIZE];
+    struct {
+        uint32_t code, packno;
+        uint8_t data[ISP_DATA_SIZE];
+    } cookie;
+} PACKET;
 
-    union {
-        uint8_t raw[ISP_PACKET_SIZE];
-        struct {
-            uint32_t code, packno;
-            uint8_t data[ISP_DATA_SIZE];
-        } cookie;
-    } pack;
-    pack.cookie.code = lsb32(code);
-    pack.cookie.packno = lsb32(packno);
-    memcpy(pack.cookie.data, data, ISP_DATA_SIZE);
+// fill in packet, return checksum
+static uint32_t isp_pack(PACKET* pp, uint32_t code, uint32_t no, const void* data)
+{
+    pp->cookie.code = lsb32(code);
+    pp->cookie.packno = lsb32(no);
+    memcpy(pp->cookie.data, data, ISP_DATA_SIZE);
 
-    // calc checksum
     uint32_t checksum = 0;
     for (size_t i = 0; i < ISP_PACKET_SIZE; ++i)
-        checksum += pack.raw[i];
+        checksum += pp->raw[i];
+    return checksum;
+}
+
+// account packet sent
+static void isp_sent(ISP* isp)
+{
+    if (isp->stats != NULL)
+        isp->stats->bytes_tx += ISP_PACKET_SIZE;
+}
+
+// account response read by ucomm_read_until(), return true if complete
+static bool isp_received(ISP* isp, ssize_t part)
+{
+    ISP_STATS* stats = isp->stats;
+    if (stats != NULL && part >= 0) {
+        stats->bytes_rx += part;
+        stats->timeouts += (part != ISP_PACKET_SIZE);
+    }
+    if (part >= 0 && part != ISP_PACKET_SIZE)
+        errno = ETIMEDOUT;
+    return (part == ISP_PACKET_SIZE);
+}
+
+// account ack, check its checksum
+static bool isp_acked(ISP* isp, uint32_t code, uint32_t checksum, uint64_t usec)
+{
+    ISP_STATS* stats = isp->stats;
+    if (code != lsb32(checksum)) {
+        if (stats != NULL)
+            ++stats->mismatches;
+        errno = EILSEQ;
+        return false;
+    }
+    if (stats == NULL)
+        return true;
+
+    size_t bin = 0;
+    while (bin + 1 < ISP_RTT_BINS && (usec >> (bin + 1)) != 0)
+        ++bin;
+    ++stats->rtt[bin];
+    ++stats->packets;
+    stats->rtt_sum += usec;
+    stats->rtt_max = max(stats->rtt_max, usec);
+    return true;
+}
+
+// send one packet and read response into pack
+static bool isp_transact(ISP* isp, uint32_t code, const void* data, PACKET* pack)
+{
+    uint32_t checksum = isp_pack(pack, code, isp->packno, data);
 
     // send packet
-    if (ucomm_write(fd, pack.raw, ISP_PACKET_SIZE) != ISP_PACKET_SIZE)
+    uint64_t start = ucomm_clock();
+    if (ucomm_write(isp->fd, pack->raw, ISP_PACKET_SIZE) != ISP_PACKET_SIZE)
         return false;
+    isp_sent(isp);
 
     // read response unless mcu is reset
     if (code < ISP_RUN_APROM || code > ISP_RESET) {
-        if (ucomm_read(fd, pack.raw, ISP_PACKET_SIZE) != ISP_PACKET_SIZE)
+        if (!isp_received(isp, ucomm_read_until(isp->fd, pack->raw, ISP_PACKET_SIZE,
+                ucomm_clock() + isp->timeout * 1000)))
             return false;
-        if (pack.cookie.code != lsb32(checksum))
+        if (!isp_acked(isp, pack->cookie.code, checksum, ucomm_clock() - start))
             return false;
-        // save response data, except APROM update
-        if (code > 0)
-            memcpy(data, pack.cookie.data, ISP_DATA_SIZE);
     }
 
     // success
-    ++packno;
+    ++isp->packno;
     return true;
 }
 
-// Nuvoton ISP: write bytes to APROM
-bool isp_write(uint32_t address, uint8_t* image, size_t length, intptr_t fd)
+// Nuvoton ISP: send one command and read response
+bool isp_command(ISP* isp, uint32_t code, void* data)
 {
-    uint8_t data[ISP_DATA_SIZE];
-
-    // first part
-    size_t cnt = min(length, ISP_DATA_SIZE - 8);
-    ((uint32_t*)data)[0] = lsb32(address);
-    ((uint32_t*)data)[1] = lsb32(length);
-    memcpy(&data[8], image, cnt);
-    if (!isp_command(ISP_UPDATE_APROM, data, fd))
+    PACKET pack;
+    if (!isp_transact(isp, code, data, &pack))
         return false;
+    // save response data, except APROM update
+    if (code > 0)
+        memcpy(data, pack.cookie.data, ISP_DATA_SIZE);
+    return true;
+}
+
+// Nuvoton ISP: stream CONNECT packets, scan input for ack
+// gap is time to listen after each packet (us), deadline 0 is for no deadline
+bool isp_connect(ISP* isp, unsigned gap, uint64_t deadline)
+{
+    PACKET pack;
+    uint8_t data[ISP_DATA_SIZE] = {0};
+    uint32_t checksum = lsb32(isp_pack(&pack, ISP_CONNECT, isp->packno, data));
 
-    for (; cnt + ISP_DATA_SIZE <= length; cnt += ISP_DATA_SIZE)
-        if (!isp_command(0, &image[cnt], fd))
+    uint8_t buf[2 * ISP_PACKET_SIZE];
+    size_t len = 0;
+    while (deadline == 0 || ucomm_clock() < deadline) {
+        if (ucomm_write(isp->fd, pack.raw, ISP_PACKET_SIZE) != ISP_PACKET_SIZE)
             return false;
+        ssize_t part = ucomm_read_until(isp->fd, &buf[len], sizeof(buf) - len,
+            ucomm_clock() + gap);
+        if (part < 0)
+            return false;
+        len += part;
+
+        // look for checksum at start of response
+        size_t i = 0;
+        for (; i + sizeof(checksum) <= len; ++i)
+            if (memcmp(&buf[i], &checksum, sizeof(checksum)) == 0)
+                break;
+        if (i + sizeof(checksum) > len)
+            i = len - min(len, sizeof(checksum) - 1);   // keep possible prefix
+        memmove(buf, &buf[i], len - i);
+        len -= i;
+
+        if (len >= ISP_PACKET_SIZE) {
+            // drain acks for the packets still in flight
+            z_delay(2 * gap / 1000 + 1);
+            ucomm_purge(isp->fd);
+            // all responses are of the same size from now on
+            ucomm_frame(isp->fd, ISP_PACKET_SIZE);
+            ++isp->packno;
+            return true;
+        }
+    }
+
+    errno = ETIMEDOUT;
+    return false;
+}
+
+// offset of UPDATE_APROM payload #index
+static size_t isp_offset(size_t index)
+{
+    return index ? (ISP_DATA_SIZE - 8) + (index - 1) * ISP_DATA_SIZE : 0;
+}
+
+// UPDATE_APROM payload #index
+static const uint8_t* isp_chunk(uint8_t* data, size_t index, uint32_t address,
+    const uint8_t* image, size_t length)
+{
+    // first part
+    if (index == 0) {
+        ((uint32_t*)data)[0] = lsb32(address);
+        ((uint32_t*)data)[1] = lsb32(length);
+        memcpy(&data[8], image, min(length, ISP_DATA_SIZE - 8));
+        return data;
+    }
+
+    size_t offset = isp_offset(index);
+    if (offset + ISP_DATA_SIZE <= length)
+        return &image[offset];
 
     // last incomplete part
-    if (cnt < length) {
-        memcpy(data, &image[cnt], length - cnt);
-        if (!isp_command(0, data, fd))
+    memset(data, 0, ISP_DATA_SIZE);
+    memcpy(data, &image[offset], length - offset);
+    return data;
+}
+
+// number of UPDATE_APROM packets
+static size_t isp_chunks(size_t length)
+{
+    return (length <= ISP_DATA_SIZE - 8) ? 1 :
+        1 + (length - (ISP_DATA_SIZE - 8) + ISP_DATA_SIZE - 1) / ISP_DATA_SIZE;
+}
+
+// report bytes of acked packets
+static void isp_progress(ISP* isp, uint32_t address, size_t length, size_t acked)
+{
+    if (isp->progress != NULL)
+        isp->progress(isp->ctx, address + min(isp_offset(acked), length));
+}
+
+// 16-bit sum reported by final UPDATE_APROM ack
+static uint16_t isp_sum(const PACKET* ack)
+{
+    return (ack->cookie.data[1] << 8) | ack->cookie.data[0];
+}
+
+// send packets one by one, count acked ones
+static bool isp_sequence(ISP* isp, uint32_t address, const uint8_t* image,
+    size_t length, size_t* acked, uint16_t* sum)
+{
+    PACKET ack;
+    uint8_t data[ISP_DATA_SIZE];
+    size_t n = isp_chunks(length);
+    for (*acked = 0; *acked < n; ) {
+        if (!isp_transact(isp, *acked ? 0 : ISP_UPDATE_APROM,
+                isp_chunk(data, *acked, address, image, length), &ack))
+            return false;
+        isp_progress(isp, address, length, ++*acked);
+    }
+    *sum = isp_sum(&ack);
+    return true;
+}
+
+// keep up to window packets in flight, match acks in order
+static bool isp_pipeline(ISP* isp, uint32_t address, const uint8_t* image,
+    size_t length, unsigned window, size_t* packed, uint16_t* sum)
+{
+    uint32_t checksum[ISP_MAX_WINDOW];
+    uint64_t sent_at[ISP_MAX_WINDOW];
+    size_t n = isp_chunks(length), sent = 0, acked = 0;
+    *packed = 0;
+
+    while (acked < n) {
+        // fill the window
+        for (; sent < n && sent - acked < window; ++sent) {
+            PACKET pack;
+            uint8_t data[ISP_DATA_SIZE];
+            checksum[sent % window] = isp_pack(&pack, sent ? 0 : ISP_UPDATE_APROM,
+                isp->packno + sent, isp_chunk(data, sent, address, image, length));
+            sent_at[sent % window] = ucomm_clock();
+            if (ucomm_write(isp->fd, pack.raw, ISP_PACKET_SIZE) != ISP_PACKET_SIZE)
+                return false;
+            isp_sent(isp);
+        }
+
+        // the oldest packet must be acked first
+        PACKET ack;
+        if (!isp_received(isp, ucomm_read_until(isp->fd, ack.raw, ISP_PACKET_SIZE,
+                ucomm_clock() + isp->timeout * 1000)))
             return false;
+        if (!isp_acked(isp, ack.cookie.code, checksum[acked % window],
+                ucomm_clock() - sent_at[acked % window]))
+            return false;
+        // LDROM may answer with either packno or packno + 1
+        uint32_t delta = lsb32(ack.cookie.packno) - (isp->packno + acked);
+        if (delta > 1)
+            return false;
+        *packed = ++acked;
+        isp_progress(isp, address, length, acked);
+        *sum = isp_sum(&ack);
+    }
+
+    isp->packno += n;
+    return true;
+}
+
+// drop packets in flight and resync packet number
+static bool isp_resync(ISP* isp)
+{
+    if (isp->stats != NULL)
+        ++isp->stats->resyncs;
+    z_delay(isp->timeout);
+    ucomm_purge(isp->fd);
+
+    // might take a few packets to get in frame again
+    for (int retry = 0; retry < 3; ++retry) {
+        uint8_t data[ISP_DATA_SIZE] = {0};
+        ((uint32_t*)data)[0] = lsb32(isp->packno);
+        if (isp_command(isp, ISP_SYNC_PACKNO, data))
+            return true;
+        ucomm_purge(isp->fd);
     }
+    return false;
+}
 
+// Nuvoton ISP: isp_command() with resync and retry while budget lasts
+// note: for commands that may be repeated (all but UPDATE_APROM)
+bool isp_request(ISP* isp, uint32_t code, void* data)
+{
+    while (!isp_command(isp, code, data)) {
+        if (isp->retries == 0)
+            return false;
+        --isp->retries;
+        if (!isp_resync(isp))
+            return false;
+    }
     return true;
 }
+
+// Nuvoton ISP: write bytes to APROM
+bool isp_write(ISP* isp, uint32_t address, const uint8_t* image, size_t length,
+    unsigned window)
+{
+    window = min(window, ISP_MAX_WINDOW);
+    for (size_t offset = 0; ; ) {
+        size_t acked;
+        uint16_t sum;
+        if ((window > 1)
+            ? isp_pipeline(isp, address + offset, &image[offset], length - offset,
+                window, &acked, &sum)
+            : isp_sequence(isp, address + offset, &image[offset], length - offset,
+                &acked, &sum)) {
+            // LDROM reports 16-bit sum of the data it has just written
+            if (isp->verify) {
+                for (size_t i = 0; i < length; ++i)
+                    sum -= image[i];
+                if (sum != 0) {
+                    errno = EBADMSG;
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        if (window > 1)
+            window = 1;     // bootloader cannot keep up, fall back to stop-and-wait
+        else if (isp->retries > 0)
+            --isp->retries; // noisy line
+        else
+            return false;
+        if (!isp_resync(isp))
+            return false;
+
+        // new UPDATE_APROM erases first page, so start at page of first unacked byte
+        // note: LDROM sums only the current run, so verify must rewrite the whole range
+        size_t restart = address + offset + isp_offset(acked);
+        restart = (isp->page && !isp->verify) ? (restart & ~(isp->page - 1)) : address;
+        offset = (restart > address) ? restart - address : 0;
+    }
+}
+
+// Nuvoton ISP: step baud rate up while link passes a burst of CONNECT packets
+// note: needs LDROM that follows host rate changes, stock one runs at fixed rate
+unsigned isp_autobaud(ISP* isp, unsigned baud)
+{
+    static const unsigned rates[] = {
+        230400, 460800, 921600, 1000000, 1500000, 2000000, 3000000
+    };
+
+    for (size_t i = 0; i < sizeof(rates) / sizeof(rates[0]); ++i) {
+        if (rates[i] <= baud)
+            continue;
+        if (ucomm_reset(isp->fd, rates[i], 0x801) < 0)
+            break;
+
+        bool ok = true;
+        for (int j = 0; ok && j < ISP_BURST; ++j) {
+            uint8_t data[ISP_DATA_SIZE] = {0};
+            ok = isp_command(isp, ISP_CONNECT, data);
+        }
+        if (!ok) {
+            // back off to the last good rate
+            ucomm_reset(isp->fd, baud, 0x801);
+            isp_resync(isp);
+            break;
+        }
+        baud = rates[i];
+    }
+
+    return baud;
+}
@@ -8,6 +8,11 @@
 enum {
     ISP_PACKET_SIZE = 64,
     ISP_DATA_SIZE = ISP_PACKET_SIZE - 8,
+    ISP_MAX_WINDOW = 32,
+    ISP_BURST = 8,
+    ISP_TURNAROUND = 5,             // ms
+    ISP_ERASE_TIMEOUT = 3000,       // ms
+    ISP_RTT_BINS = 20,              // 1us..1s
 
     ISP_UPDATE_APROM = 0xa0,
     ISP_UPDATE_CONFIG = 0xa1,
@@ -37,7 +42,36 @@ typedef union {
     } bit;
 } CONFIG;
 
-bool isp_command(uint32_t code, void* data, intptr_t fd);
-bool isp_write(uint32_t address, uint8_t* image, size_t length, intptr_t fd);
+// transfer counters
+typedef struct {
+    uint64_t packets;               // acked
+    uint64_t bytes_tx, bytes_rx;
+    uint64_t rtt[ISP_RTT_BINS];     // [2^i, 2^(i+1)) us
+    uint64_t rtt_sum, rtt_max;      // us
+    unsigned mismatches, timeouts, resyncs;
+} ISP_STATS;
+
+// per-connection state
+typedef struct {
+    intptr_t fd;
+    uint32_t packno;
+    unsigned timeout;   // response deadline, ms
+    unsigned retries;   // resync budget left
+    size_t page;        // flash page size to resend from, 0 if unknown
+    bool verify;        // check sum in final UPDATE_APROM ack
+    ISP_STATS* stats;   // NULL if not wanted
+    // UPDATE_APROM acked below address, NULL if not wanted
+    void (*progress)(void* ctx, uint32_t address);
+    void* ctx;
+} ISP;
+// ISP isp = { .fd = ucomm_open(port, 115200, 0x801), .packno = 1,
+//     .timeout = UCOMM_DEFAULT_TIMEOUT };
+
+bool isp_command(ISP* isp, uint32_t code, void* data);
+bool isp_request(ISP* isp, uint32_t code, void* data);
+bool isp_connect(ISP* isp, unsigned gap, uint64_t deadline);
+bool isp_write(ISP* isp, uint32_t address, const uint8_t* image, size_t length,
+    unsigned window);
+unsigned isp_autobaud(ISP* isp, unsigned baud);
 
 #endif // ISP_H
@@ -0,0 +1,410 @@
+//
+// nuvobench
+//
+// Benchmark HEX parsing, HEX emission, port scan and ISP throughput
+// Print results as JSON lines
+//
+// https://github.com/matveyt/nuvotool
+//
+
+#if !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+#include "stdz.h"
+#include "ihx.h"
+#include "isp.h"
+#include "ucomm.h"
+#include <sys/stat.h>
+#include <unistd.h>
+
+// user options
+static struct {
+    char* sim;
+    double seconds;     // min time per measurement
+    unsigned entries;   // in synthetic sysfs
+    size_t cases;       // of HEX decoder self-test
+    bool check;         // self-test only
+} opt = {
+    .seconds = 0.5,
+    .entries = 4096,
+    .cases = 100000,
+};
+
+/*noreturn*/
+static void usage(int status)
+{
+    if (status != 0)
+        fprintf(stderr, "Try '%s --help' for more information.\n", z_getprogname());
+    else
+        printf(
+"Usage: %s [OPTION]...\n"
+"Benchmark HEX parsing, HEX emission, port scan and ISP throughput. Print JSON lines.\n"
+"\n"
+"-s, --sim=PATH         Use simulator (default ./nuvosim)\n"
+"-t, --time=SEC         Repeat each measurement for SEC at least (default 0.5)\n"
+"-P, --ports=N          Scan synthetic sysfs of N ttys (default 4096, 0 to skip)\n"
+"-c, --check[=N]        Only check SIMD HEX decoders on N random records\n"
+"                       (default 100000, always done before benchmarks)\n"
+"-h, --help             Show this message and exit\n",
+        z_getprogname());
+    exit(status);
+}
+
+static void parse_args(int argc, char* argv[])
+{
+    z_setprogname(argv[0]);
+
+    static struct z_option lopts[] = {
+        { "sim", z_required_argument, NULL, 's' },
+        { "time", z_required_argument, NULL, 't' },
+        { "ports", z_required_argument, NULL, 'P' },
+        { "check", z_optional_argument, NULL, 'c' },
+        { "help", z_no_argument, NULL, 'h' },
+        {0}
+    };
+
+    int c;
+    while ((c = z_getopt_long(argc, argv, "s:t:P:c::h", lopts, NULL)) != -1) {
+        switch (c) {
+        case 's':
+            free(opt.sim);
+            opt.sim = z_strdup(z_optarg);
+        break;
+        case 't':
+            opt.seconds = strtod(z_optarg, NULL);
+        break;
+        case 'P':
+            opt.entries = strtoul(z_optarg, NULL, 0);
+        break;
+        case 'c':
+            opt.check = true;
+            if (z_optarg != NULL)
+                opt.cases = strtoul(z_optarg, NULL, 0);
+        break;
+        case 'h':
+            usage(EXIT_SUCCESS);
+        break;
+        case '?':
+            usage(EXIT_FAILURE);
+        break;
+        }
+    }
+
+    if (z_optind < argc)
+        usage(EXIT_FAILURE);
+    if (opt.sim == NULL)
+        opt.sim = z_strdup("./nuvosim");
+}
+
+// pseudo-random image, some blank runs included
+static void make_image(IHX* ihx, size_t sz)
+{
+    uint32_t seed = (uint32_t)sz;
+    ihx->image = (uint8_t*)z_malloc(sz);
+    for (size_t i = 0; i < sz; ++i) {
+        seed = seed * 1103515245 + 12345;
+        ihx->image[i] = ((i >> 10) % 8 == 3) ? 0xff : (uint8_t)(seed >> 16);
+    }
+    ihx->sz = sz;
+    ihx->base = ihx->entry = 0;
+    ihx->extent = NULL;
+    ihx->extents = 0;
+}
+
+// pseudo-random for check_decode()
+static unsigned lcg(uint32_t* seed)
+{
+    *seed = *seed * 1103515245 + 12345;
+    return *seed >> 16;
+}
+
+// SIMD HEX decoders must match the scalar one on random records
+static void check_decode(size_t cases)
+{
+    IHX_DECODER decoder[IHX_MAX_DECODERS];
+    size_t n = ihx_decoders(decoder);
+
+    static const char digits[] = "0123456789abcdefABCDEF";
+    char src[2 * 255];
+    uint8_t want[255], got[255];
+    uint32_t seed = 1;
+    size_t mismatches = 0;
+    for (size_t i = 0; i < cases; ++i) {
+        // all record lengths, some with a stray byte
+        size_t sz = lcg(&seed) % 256;
+        for (size_t j = 0; j < 2 * sz; ++j)
+            src[j] = digits[lcg(&seed) % (sizeof(digits) - 1)];
+        if (sz > 0 && lcg(&seed) % 4 == 0) {
+            size_t j = lcg(&seed) % (2 * sz);
+            src[j] = (char)lcg(&seed);
+        }
+        uint8_t sum0 = (uint8_t)lcg(&seed), sum = sum0;
+        bool ok = decoder[0](want, src, sz, &sum);
+
+        for (size_t k = 1; k < n; ++k) {
+            uint8_t sum2 = sum0;
+            bool ok2 = decoder[k](got, src, sz, &sum2);
+            if (ok2 != ok || (ok && (sum2 != sum || memcmp(got, want, sz) != 0)))
+                ++mismatches;
+        }
+    }
+
+    printf("{\"check\":\"decode\",\"cases\":%zu,\"kernels\":%zu,\"mismatches\":%zu}\n",
+        cases, n - 1, mismatches);
+    fflush(stdout);
+    if (mismatches > 0)
+        z_error(EXIT_FAILURE, EILSEQ, "check_decode");
+}
+
+// HEX corpus => ihx_dump and ihx_load speed
+static void bench_ihx(size_t sz)
+{
+    IHX ihx;
+    make_image(&ihx, sz);
+    const char* records = (sz > 0x100000) ? "04" : (sz > 0x10000) ? "02" : "00";
+
+    FILE* f = tmpfile();
+    if (f == NULL)
+        z_error(EXIT_FAILURE, errno, "tmpfile");
+
+    // emit
+    unsigned n = 0;
+    uint64_t start = z_clock(), usec;
+    do {
+        rewind(f);
+        ihx_dump(&ihx, 0xff, 0, f);
+        ++n;
+    } while ((usec = z_clock() - start) < opt.seconds * 1e6);
+    fflush(f);
+    long text = ftell(f);
+    printf("{\"bench\":\"ihx_dump\",\"image\":%zu,\"records\":\"%s\",\"bytes\":%ld,"
+        "\"runs\":%u,\"mb_per_s\":%.2f}\n", sz, records, text, n,
+        (double)text * n / usec);
+    ihx_free(&ihx);
+
+    // parse
+    n = 0;
+    start = z_clock();
+    do {
+        rewind(f);
+        if (ihx_load(&ihx, 0xff, f) != 'x' || ihx.sz != sz)
+            z_error(EXIT_FAILURE, EILSEQ, "ihx_load(%zu)", sz);
+        ihx_free(&ihx);
+        ++n;
+    } while ((usec = z_clock() - start) < opt.seconds * 1e6);
+    printf("{\"bench\":\"ihx_load\",\"image\":%zu,\"records\":\"%s\",\"bytes\":%ld,"
+        "\"runs\":%u,\"mb_per_s\":%.2f}\n", sz, records, text, n,
+        (double)text * n / usec);
+    fflush(stdout);
+
+    fclose(f);
+}
+
+// make file or directory (content == NULL) or symlink (link != NULL)
+static void make(const char* root, const char* link, const char* content,
+    const char* fmt, ...)
+{
+    char* path;
+    char* rel;
+    va_list args;
+    va_start(args, fmt);
+    z_vasprintf(&rel, fmt, args);
+    va_end(args);
+    z_asprintf(&path, "%s/%s", root, rel);
+
+    int rc = 0;
+    if (link != NULL)
+        rc = symlink(link, path);
+    else if (content == NULL)
+        rc = mkdir(path, 0755);
+    else {
+        FILE* f = fopen(path, "w");
+        rc = (f == NULL || fputs(content, f) < 0 || fclose(f) != 0) ? -1 : 0;
+    }
+    if (rc < 0)
+        z_error(EXIT_FAILURE, errno, "%s", path);
+    free(path);
+    free(rel);
+}
+
+// sysfs-like tty class: mostly virtual, 16 USB (FTDI) and 4 platform ports
+static void make_sysfs(const char* root, unsigned entries)
+{
+    char target[256];
+    make(root, NULL, NULL, "tty");
+    make(root, NULL, NULL, "drivers");
+    make(root, NULL, NULL, "drivers/ftdi_sio");
+    make(root, NULL, NULL, "drivers/serial8250");
+    make(root, NULL, NULL, "devices");
+    make(root, NULL, NULL, "devices/platform");
+    make(root, NULL, "", "devices/platform/uevent");
+    snprintf(target, sizeof(target), "%s/drivers/serial8250", root);
+    make(root, target, NULL, "devices/platform/driver");
+    make(root, NULL, NULL, "devices/usb1");
+
+    unsigned i = 0;
+    for (; i < 4 && i < entries; ++i) {
+        make(root, NULL, NULL, "tty/ttyS%u", i);
+        snprintf(target, sizeof(target), "%s/devices/platform", root);
+        make(root, target, NULL, "tty/ttyS%u/device", i);
+    }
+    for (unsigned k = 0; k < 16 && i < entries; ++k, ++i) {
+        char serial[16];
+        snprintf(serial, sizeof(serial), "FT%04u\n", k);
+        make(root, NULL, NULL, "devices/usb1/1-%u", k);
+        make(root, NULL, "", "devices/usb1/1-%u/uevent", k);
+        make(root, NULL, "0403\n", "devices/usb1/1-%u/idVendor", k);
+        make(root, NULL, "6001\n", "devices/usb1/1-%u/idProduct", k);
+        make(root, NULL, serial, "devices/usb1/1-%u/serial", k);
+        make(root, NULL, NULL, "devices/usb1/1-%u/1-%u:1.0", k, k);
+        make(root, NULL, "", "devices/usb1/1-%u/1-%u:1.0/uevent", k, k);
+        make(root, NULL, NULL, "devices/usb1/1-%u/1-%u:1.0/ttyUSB%u", k, k, k);
+        make(root, NULL, "", "devices/usb1/1-%u/1-%u:1.0/ttyUSB%u/uevent", k, k, k);
+        snprintf(target, sizeof(target), "%s/drivers/ftdi_sio", root);
+        make(root, target, NULL, "devices/usb1/1-%u/1-%u:1.0/ttyUSB%u/driver", k, k, k);
+        make(root, NULL, NULL, "tty/ttyUSB%u", k);
+        snprintf(target, sizeof(target), "%s/devices/usb1/1-%u/1-%u:1.0/ttyUSB%u", root,
+            k, k, k);
+        make(root, target, NULL, "tty/ttyUSB%u/device", k);
+    }
+    // virtual consoles (skipped by name) and others (no device)
+    for (unsigned k = 0; i < entries; ++k, ++i)
+        make(root, NULL, NULL, (k % 2) ? "tty/hvc%u" : "tty/tty%u", k / 2);
+}
+
+// ucomm_ports() and ucomm_ports_info() on synthetic sysfs
+static void bench_ports(unsigned entries)
+{
+    char root[] = "/tmp/nuvobench.XXXXXX";
+    if (mkdtemp(root) == NULL)
+        z_error(EXIT_FAILURE, errno, "mkdtemp");
+    make_sysfs(root, entries);
+    char* tty;
+    z_asprintf(&tty, "%s/tty", root);
+    setenv("UCOMM_SYSFS", tty, 1);
+    free(tty);
+
+    for (int info = 0; info < 2; ++info) {
+        unsigned n = 0;
+        size_t ports = 0;
+        uint64_t start = z_clock(), usec;
+        do {
+            if (info) {
+                struct ucomm_port* p;
+                ports = ucomm_ports_info(&p);
+                if (ports > 4 && (p[4].vid != 0x0403 || strcmp(p[4].driver, "ftdi_sio")))
+                    z_error(EXIT_FAILURE, EILSEQ, "ucomm_ports_info(%s)", p[4].port);
+                free(p);
+            } else {
+                char** p;
+                ports = ucomm_ports(&p);
+                free(p);
+            }
+            ++n;
+        } while ((usec = z_clock() - start) < opt.seconds * 1e6);
+        printf("{\"bench\":\"%s\",\"entries\":%u,\"ports\":%zu,\"runs\":%u,"
+            "\"us_per_scan\":%.1f}\n", info ? "ucomm_ports_info" : "ucomm_ports",
+            entries, ports, n, (double)usec / n);
+        fflush(stdout);
+    }
+
+    unsetenv("UCOMM_SYSFS");
+    char* cmd;
+    z_asprintf(&cmd, "rm -rf '%s'", root);
+    if (system(cmd) != 0)
+        z_warnx("cannot remove %s", root);
+    free(cmd);
+}
+
+// full ISP session against simulator
+static void bench_isp(const char* port, const IHX* ihx, unsigned window)
+{
+    uint64_t t[7];
+    uint8_t data[ISP_DATA_SIZE];
+
+    t[0] = z_clock();
+    ISP isp = { .fd = ucomm_open(port, 115200, 0x801), .packno = 1,
+        .timeout = UCOMM_DEFAULT_TIMEOUT };
+    if (isp.fd < 0)
+        z_error(EXIT_FAILURE, errno, "ucomm_open(%s)", port);
+
+    t[1] = z_clock();
+    if (!isp_connect(&isp, 10000, t[1] + 5000000))   // 10 ms gap, 5 s deadline
+        z_error(EXIT_FAILURE, errno, "CONNECT failed");
+    uint32_t packno = isp.packno;
+
+    t[2] = z_clock();
+    if (!isp_command(&isp, ISP_SYNC_PACKNO, data)
+        || !isp_command(&isp, ISP_GET_DEVICEID, data)
+        || !isp_command(&isp, ISP_GET_FWVER, data)
+        || !isp_command(&isp, ISP_READ_CONFIG, data))
+        z_error(EXIT_FAILURE, errno, "chip info failed");
+
+    t[3] = z_clock();
+    isp.timeout = ISP_ERASE_TIMEOUT;
+    if (!isp_command(&isp, ISP_ERASE_ALL, data))
+        z_error(EXIT_FAILURE, errno, "ERASE_ALL failed");
+    isp.timeout = UCOMM_DEFAULT_TIMEOUT;
+
+    t[4] = z_clock();
+    uint32_t write_packno = isp.packno;
+    if (!isp_write(&isp, ihx->base, ihx->image, ihx->sz, window))
+        z_error(EXIT_FAILURE, errno, "isp_write(%zu)", ihx->sz);
+    uint32_t packets = isp.packno - write_packno;
+
+    t[5] = z_clock();
+    if (!isp_command(&isp, ISP_RUN_APROM, data))
+        z_error(EXIT_FAILURE, errno, "RUN_APROM failed");
+    ucomm_close(isp.fd);
+    t[6] = z_clock();
+
+    double write_s = (t[5] - t[4]) / 1e6;
+    printf("{\"bench\":\"isp\",\"window\":%u,\"bytes\":%zu,\"packets\":%u,"
+        "\"open_ms\":%.3f,\"connect_ms\":%.3f,\"chip_info_ms\":%.3f,\"erase_ms\":%.3f,"
+        "\"write_ms\":%.3f,\"run_ms\":%.3f,\"total_ms\":%.3f,"
+        "\"packets_per_s\":%.1f,\"bytes_per_s\":%.1f,\"commands\":%u}\n",
+        window, ihx->sz, packets, (t[1] - t[0]) / 1e3, (t[2] - t[1]) / 1e3,
+        (t[3] - t[2]) / 1e3, (t[4] - t[3]) / 1e3, (t[5] - t[4]) / 1e3,
+        (t[6] - t[5]) / 1e3, (t[6] - t[0]) / 1e3, packets / write_s,
+        ihx->sz / write_s, isp.packno - packno);
+    fflush(stdout);
+}
+
+int main(int argc, char* argv[])
+{
+    parse_args(argc, argv);
+
+    check_decode(opt.cases);
+    if (opt.check) {
+        free(opt.sim);
+        return EXIT_SUCCESS;
+    }
+
+    static const size_t sizes[] = { 1024, 0x10000, 0x80000, 0x400000 };
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i)
+        bench_ihx(sizes[i]);
+    if (opt.entries > 0)
+        bench_ports(opt.entries);
+
+    static const unsigned windows[] = { 1, 4, 16 };
+    const size_t nwindows = sizeof(windows) / sizeof(windows[0]);
+    char* cmd;
+    z_asprintf(&cmd, "%s --sessions=%zu", opt.sim, nwindows);
+    FILE* sim = popen(cmd, "r");
+    free(cmd);
+    char port[256];
+    if (sim == NULL || fgets(port, sizeof(port), sim) == NULL)
+        z_error(EXIT_FAILURE, errno, "popen(%s)", opt.sim);
+    port[strcspn(port, "\n")] = 0;
+
+    // N76E003 APROM less 4K LDROM
+    IHX ihx;
+    make_image(&ihx, 14 * 1024);
+    for (size_t i = 0; i < nwindows; ++i)
+        bench_isp(port, &ihx, windows[i]);
+    ihx_free(&ihx);
+
+    pclose(sim);
+    free(opt.sim);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,347 @@
+//
+// nuvosim
+//
+// Nuvoton ISP device simulator
+// Serve LDROM side of ISP protocol over a pseudo-terminal
+//
+// https://github.com/matveyt/nuvotool
+//
+
+#if !defined(_XOPEN_SOURCE)
+#define _XOPEN_SOURCE 700
+#endif
+#include "stdz.h"
+#include "bswap.h"
+#include "isp.h"
+#include <fcntl.h>
+#include <termios.h>
+#include <unistd.h>
+
+// user options
+static struct {
+    uint32_t did;
+    size_t flash, page;
+    uint8_t fw_version;
+    CONFIG config;
+    unsigned latency;       // ms per command
+    unsigned erase_time;    // ms for ERASE_ALL
+    unsigned sessions;      // exit after N RUN_APROM, 0 for never
+    unsigned faults;        // spoil every Nth response, 0 for never
+    size_t stuck;           // flash byte that cannot be programmed
+    char* link;
+    char* dump;
+    bool verbose;
+} opt = {
+    .did = 0x3650,          // N76E003
+    .flash = 18 * 1024,
+    .page = 128,
+    .fw_version = 0x27,
+    .config = { .raw = { 0x7f, 0xfb, 0xff, 0xff, 0xff } },  // boot LDROM, 4K LDROM
+    .stuck = SIZE_MAX,
+};
+
+// device state
+static struct {
+    uint8_t* flash;
+    bool* erased;           // page erased by current UPDATE_APROM
+    size_t aprom;           // APROM size
+    uint32_t packno;
+    size_t address, remain; // UPDATE_APROM in progress
+    uint16_t checksum;
+} dev;
+
+/*noreturn*/
+static void usage(int status)
+{
+    if (status != 0)
+        fprintf(stderr, "Try '%s --help' for more information.\n", z_getprogname());
+    else
+        printf(
+"Usage: %s [OPTION]...\n"
+"Nuvoton ISP device simulator. Serve LDROM protocol over a pseudo-terminal.\n"
+"\n"
+"-d, --device=ID        Set device ID (default 0x3650)\n"
+"-f, --flash=SIZE       Set flash size (default 18432)\n"
+"-P, --page=SIZE        Set page size (default 128)\n"
+"-V, --fw-version=N     Set firmware version (default 0x27)\n"
+"-C, --config=XX,...    Set CONFIG0..4 (default 7f,fb,ff,ff,ff)\n"
+"-t, --latency=MS       Delay every response by MS\n"
+"-e, --erase-time=MS    Delay ERASE_ALL response by MS\n"
+"-n, --sessions=N       Exit after N RUN_APROM commands\n"
+"-E, --faults=N         Drop or corrupt every Nth response (in turn)\n"
+"-k, --stuck=ADDR       Make flash byte at ADDR fail to program\n"
+"-o, --link=PATH        Make symlink to pseudo-terminal\n"
+"-D, --dump=FILE        Save flash memory to FILE on exit\n"
+"-v, --verbose          Log commands to stderr\n"
+"-h, --help             Show this message and exit\n"
+"\n"
+"Pseudo-terminal name is printed on standard output.\n",
+        z_getprogname());
+    exit(status);
+}
+
+static void parse_args(int argc, char* argv[])
+{
+    z_setprogname(argv[0]);
+
+    static struct z_option lopts[] = {
+        { "device", z_required_argument, NULL, 'd' },
+        { "flash", z_required_argument, NULL, 'f' },
+        { "page", z_required_argument, NULL, 'P' },
+        { "fw-version", z_required_argument, NULL, 'V' },
+        { "config", z_required_argument, NULL, 'C' },
+        { "latency", z_required_argument, NULL, 't' },
+        { "erase-time", z_required_argument, NULL, 'e' },
+        { "sessions", z_required_argument, NULL, 'n' },
+        { "faults", z_required_argument, NULL, 'E' },
+        { "stuck", z_required_argument, NULL, 'k' },
+        { "link", z_required_argument, NULL, 'o' },
+        { "dump", z_required_argument, NULL, 'D' },
+        { "verbose", z_no_argument, NULL, 'v' },
+        { "help", z_no_argument, NULL, 'h' },
+        {0}
+    };
+
+    int c;
+    while ((c = z_getopt_long(argc, argv, "d:f:P:V:C:t:e:n:E:k:o:D:vh", lopts,
+            NULL)) != -1) {
+        switch (c) {
+        case 'd':
+            opt.did = strtoul(z_optarg, NULL, 0);
+        break;
+        case 'f':
+            opt.flash = strtoul(z_optarg, NULL, 0);
+        break;
+        case 'P':
+            opt.page = strtoul(z_optarg, NULL, 0);
+        break;
+        case 'V':
+            opt.fw_version = strtoul(z_optarg, NULL, 0);
+        break;
+        case 'C':
+            for (size_t i = 0; i < sizeof(CONFIG) && *z_optarg != 0; ++i) {
+                opt.config.raw[i] = strtoul(z_optarg, &z_optarg, 16);
+                if (*z_optarg == ',')
+                    ++z_optarg;
+            }
+        break;
+        case 't':
+            opt.latency = strtoul(z_optarg, NULL, 0);
+        break;
+        case 'e':
+            opt.erase_time = strtoul(z_optarg, NULL, 0);
+        break;
+        case 'n':
+            opt.sessions = strtoul(z_optarg, NULL, 0);
+        break;
+        case 'E':
+            opt.faults = strtoul(z_optarg, NULL, 0);
+        break;
+        case 'k':
+            opt.stuck = strtoul(z_optarg, NULL, 0);
+        break;
+        case 'o':
+            free(opt.link);
+            opt.link = z_strdup(z_optarg);
+        break;
+        case 'D':
+            free(opt.dump);
+            opt.dump = z_strdup(z_optarg);
+        break;
+        case 'v':
+            opt.verbose = true;
+        break;
+        case 'h':
+            usage(EXIT_SUCCESS);
+        break;
+        case '?':
+            usage(EXIT_FAILURE);
+        break;
+        }
+    }
+
+    if (z_optind < argc || opt.page == 0 || opt.flash % opt.page != 0)
+        usage(EXIT_FAILURE);
+}
+
+// LDSIZE bits => LDROM Size
+static size_t ldrom_size(void)
+{
+    unsigned sz = (7 - opt.config.bit.LDSIZE) * 1024;
+    return min(sz, 4096);
+}
+
+// program bytes, erase each page on first touch
+// checksum is of data read back (as LDROM does)
+static void update_aprom(const uint8_t* data, size_t length)
+{
+    for (size_t i = 0; i < length && dev.remain > 0; ++i, --dev.remain) {
+        size_t address = dev.address++;
+        if (address >= dev.aprom) {
+            dev.checksum += data[i];
+            continue;
+        }
+        size_t page = address / opt.page;
+        if (!dev.erased[page]) {
+            memset(&dev.flash[page * opt.page], 0xff, opt.page);
+            dev.erased[page] = true;
+        }
+        if (address != opt.stuck)
+            dev.flash[address] = data[i];
+        dev.checksum += dev.flash[address];
+    }
+}
+
+// handle one packet, fill in response
+// return false if no response
+static bool command(const uint8_t* pack, uint8_t* resp)
+{
+    uint32_t code = lsb32(((const uint32_t*)pack)[0]);
+    uint32_t packno = lsb32(((const uint32_t*)pack)[1]);
+    const uint8_t* data = &pack[8];
+    uint8_t* rdata = &resp[8];
+
+    uint32_t checksum = 0;
+    for (size_t i = 0; i < ISP_PACKET_SIZE; ++i)
+        checksum += pack[i];
+    memset(resp, 0, ISP_PACKET_SIZE);
+    ((uint32_t*)resp)[0] = lsb32(checksum);
+    dev.packno = packno + 1;
+
+    if (opt.verbose)
+        fprintf(stderr, "%s: %#04x packno=%u\n", z_getprogname(), code, packno);
+
+    switch (code) {
+    case ISP_CONNECT:
+        dev.remain = 0;
+    break;
+    case ISP_SYNC_PACKNO:
+        dev.packno = lsb32(((const uint32_t*)data)[0]);
+    break;
+    case ISP_GET_DEVICEID:
+        ((uint32_t*)rdata)[0] = lsb32(opt.did);
+    break;
+    case ISP_GET_FWVER:
+        rdata[0] = opt.fw_version;
+    break;
+    case ISP_READ_CONFIG:
+        memcpy(rdata, opt.config.raw, sizeof(CONFIG));
+    break;
+    case ISP_UPDATE_CONFIG:
+        memcpy(opt.config.raw, data, sizeof(CONFIG));
+        dev.aprom = opt.flash - ldrom_size();
+        memcpy(rdata, opt.config.raw, sizeof(CONFIG));
+    break;
+    case ISP_ERASE_ALL:
+        memset(dev.flash, 0xff, opt.flash);
+        dev.remain = 0;
+        z_delay(opt.erase_time);
+    break;
+    case ISP_UPDATE_APROM:
+        dev.address = lsb32(((const uint32_t*)data)[0]);
+        dev.remain = lsb32(((const uint32_t*)data)[1]);
+        dev.checksum = 0;
+        memset(dev.erased, 0, opt.flash / opt.page);
+        update_aprom(&data[8], ISP_DATA_SIZE - 8);
+        if (dev.remain == 0)
+            ((uint16_t*)rdata)[0] = lsb16(dev.checksum);
+    break;
+    case ISP_RUN_APROM:
+    case ISP_RUN_LDROM:
+    case ISP_RESET:
+        dev.remain = 0;
+    return false;
+    default:
+        // continue UPDATE_APROM
+        if (dev.remain > 0) {
+            update_aprom(data, ISP_DATA_SIZE);
+            if (dev.remain == 0)
+                ((uint16_t*)rdata)[0] = lsb16(dev.checksum);
+        }
+    break;
+    }
+
+    ((uint32_t*)resp)[1] = lsb32(dev.packno);
+    z_delay(opt.latency);
+    return true;
+}
+
+int main(int argc, char* argv[])
+{
+    parse_args(argc, argv);
+
+    dev.flash = (uint8_t*)memset(z_malloc(opt.flash), 0xff, opt.flash);
+    dev.erased = (bool*)z_malloc(opt.flash / opt.page * sizeof(bool));
+    dev.aprom = opt.flash - ldrom_size();
+
+    // pseudo-terminal pair
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master < 0 || grantpt(master) < 0 || unlockpt(master) < 0)
+        z_error(EXIT_FAILURE, errno, "posix_openpt");
+    const char* name = ptsname(master);
+    if (name == NULL)
+        z_error(EXIT_FAILURE, errno, "ptsname");
+
+    // keep slave open so master never sees hangup, also no echo please
+    int slave = open(name, O_RDWR | O_NOCTTY);
+    if (slave < 0)
+        z_error(EXIT_FAILURE, errno, "open(%s)", name);
+    struct termios tio;
+    tcgetattr(slave, &tio);
+    tio.c_iflag = 0;
+    tio.c_oflag = 0;
+    tio.c_lflag = 0;
+    tcsetattr(slave, TCSANOW, &tio);
+
+    if (opt.link != NULL) {
+        unlink(opt.link);
+        if (symlink(name, opt.link) < 0)
+            z_error(EXIT_FAILURE, errno, "symlink(%s)", opt.link);
+    }
+    puts(opt.link ? opt.link : name);
+    fflush(stdout);
+
+    uint8_t pack[ISP_PACKET_SIZE], resp[ISP_PACKET_SIZE];
+    size_t len = 0;
+    unsigned responses = 0;
+    for (unsigned sessions = 0; opt.sessions == 0 || sessions < opt.sessions; ) {
+        ssize_t part = read(master, &pack[len], sizeof(pack) - len);
+        if (part <= 0) {
+            if (part < 0 && errno != EINTR)
+                z_error(EXIT_FAILURE, errno, "read");
+            continue;
+        }
+        len += part;
+        if (len < sizeof(pack))
+            continue;
+        len = 0;
+
+        if (command(pack, resp)) {
+            // noisy line: lose response, then bad checksum next time
+            if (opt.faults != 0 && ++responses % opt.faults == 0) {
+                if (responses / opt.faults % 2 != 0)
+                    continue;
+                resp[0] ^= 0x55;
+            }
+            if (write(master, resp, sizeof(resp)) != sizeof(resp))
+                z_error(EXIT_FAILURE, errno, "write");
+        } else if (lsb32(((uint32_t*)pack)[0]) == ISP_RUN_APROM) {
+            ++sessions;
+        }
+    }
+
+    if (opt.dump != NULL) {
+        FILE* f = z_fopen(opt.dump, "wb");
+        if (fwrite(dev.flash, 1, opt.flash, f) != opt.flash || fclose(f) != 0)
+            z_error(EXIT_FAILURE, errno, "%s", opt.dump);
+    }
+    if (opt.link != NULL)
+        unlink(opt.link);
+    close(slave);
+    close(master);
+    free(opt.link);
+    free(opt.dump);
+    free(dev.erased);
+    free(dev.flash);
+    return EXIT_SUCCESS;
+}
@@ -7,17 +7,44 @@
 // https://github.com/matveyt/nuvotool
 //
 
+#if defined(__unix__) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
 #include "stdz.h"
+#include "cache.h"
 #include "ihx.h"
 #include "isp.h"
 #include "ucomm.h"
+#include <inttypes.h>
+#if defined(__unix__)
+#include <fnmatch.h>
+#include <glob.h>
+#include <pthread.h>
+#include <signal.h>
+#endif
 
 enum {
     CONFIG_LOCK, CONFIG_RPD, CONFIG_OCDEN, CONFIG_OCDPWM, CONFIG_CBS, CONFIG_LDSIZE,
     CONFIG_CBORST, CONFIG_BOIAP, CONFIG_CBOV, CONFIG_CBODEN, CONFIG_WDTEN
 };
 
+enum { RESET_DTR = 1, RESET_RTS = 2, RESET_MAX = 16 };
+
+enum {
+    PHASE_RESET, PHASE_CONNECT, PHASE_INFO, PHASE_ERASE, PHASE_WRITE, PHASE_CONFIG,
+    PHASE_MAX
+};
+static const char* const phase_names[PHASE_MAX] = {
+    "reset", "connect", "chip_info", "erase", "write", "config"
+};
+
+static void add_ports(const char* pattern);
+static void parse_reset(const char* seq);
 static void list_ports(void);
+static size_t page_runs(const IHX* ihx, size_t psz, IHX_EXTENT** runs);
+static size_t whole_run(const IHX* ihx, IHX_EXTENT** runs);
+static size_t diff_runs(const IHX* ihx, CACHE* cache, uint64_t* hash,
+    const IHX_EXTENT* runs, size_t n, IHX_EXTENT** changed);
 static size_t nuvoton_flashsize(uint32_t id);
 static size_t nuvoton_pagesize(uint32_t id);
 static size_t nuvoton_ldromsize(uint8_t ldsize);
@@ -30,11 +57,41 @@ static int str2int(const char* const* tokens, const int* numbers, size_t n,
 // user options
 static struct {
     char* file;
-    char* port;
+    char** ports;
+    size_t nports;
+    unsigned baud;          // 0 for auto
+    unsigned latency;       // 0 to keep
+    unsigned connect;       // ms, 0 for no limit
+    size_t nreset;
+    struct { unsigned lines, ms; } reset[RESET_MAX];
     bool erase;
+    bool update;            // trust page cache
+    bool full;
+    bool stream;            // write while reading file
+    bool loop;
+    unsigned boards;        // --loop=N, 0 for no limit
+    bool hotplug;
+    char** match;           // ATTR=GLOB
+    size_t nmatch;
+    int stats;              // 1 for text, 2 for JSON
+    unsigned window;
+    unsigned retries;       // per board
+    bool verify;
+    bool dry_run;
     unsigned config_flags;  // 1 << CONFIG_XXX
     CONFIG config;
-} opt = {0};
+} opt = {
+    .baud = 115200,
+    .latency = 1,
+    .connect = 10000,
+    // assert RTS then DTR (aka nodemcu reset)
+    .nreset = 4,
+    .reset = {
+        { RESET_RTS, 0 }, { RESET_RTS | RESET_DTR, 10 }, { RESET_DTR, 0 }, { 0, 0 }
+    },
+    .window = 1,
+    .retries = 8,
+};
 
 /*noreturn*/
 static void usage(int status)
@@ -46,16 +103,49 @@ static void usage(int status)
 "Usage: %s [OPTION]... [FILE]\n"
 "Nuvoton ISP serial programmer. Write HEX/BIN file to APROM.\n"
 "\n"
-"-p, --port=PORT        Select serial device\n"
-"-x, --erase            Erase APROM first\n"
+"-p, --port=PORT        Select serial device (repeat or use wildcards to gang)\n"
+"-b, --baud=RATE|auto   Set baud rate (default 115200)\n"
+"-r, --reset=SEQ        Set reset sequence (default r,rd:10,d,-)\n"
+"-L, --latency=MS       Set USB-serial latency timer (default 1, 0 to keep)\n"
+"-T, --connect-timeout=MS  Give up if no LDROM answers (default 10000, 0 never)\n"
+"-x, --erase            Erase APROM first (then skip blank pages)\n"
+"-u, --update           Skip pages cached as written by the last run on PORT\n"
+"-F, --full             Write all pages, even those cached as unchanged\n"
+"-w, --window=N         Keep up to N packets in flight (default 1)\n"
+"-R, --retries=N        Resync and resend on bad ack up to N times (default 8)\n"
+"-V, --verify           Check data sum that LDROM reports after each write\n"
+"-N, --dry-run          Read device and print what is to be done, change nothing\n"
+"-S, --stream           Write pages while reading FILE (single port only)\n"
+"-n, --loop[=N]         Program board after board (N boards or until killed)\n"
+"-H, --hotplug          Program each new port as soon as it appears (Linux)\n"
+"-m, --match=ATTR=GLOB  Hot-plug only ports with sysfs ATTR like GLOB (repeat)\n"
+"-s, --stats[=json]     Report phase times, round trips, throughput and errors\n"
 "-c, --config=X[,X...]  Setup CONFIG\n"
-"-l, --list-ports       List available ports only\n"
+"-l, --list-ports       List available ports (with USB ID, driver and serial)\n"
 "-h, --help             Show this message and exit\n"
 "\n"
 "Valid CONFIG fields: lock, rpd, ocden, ocdpwm, cbs, ldsize=0,1024,2048,3072,4096,\n"
 "\tcborst, boiap, cboden, cbov=2.2,2.7,3.7,4.4, wdten=disable,enable,always\n"
 "Note that '--config rpd' or '--config rpd=yes' stands for '--config rpd=0',\n"
-"\twhile '--config cborst' for '--config cborst=1', etc.\n",
+"\twhile '--config cborst' for '--config cborst=1', etc.\n"
+"Use --baud=auto only with a custom LDROM that follows host rate changes. Stock\n"
+"\tLDROM runs at a fixed rate, so the first faster probe times out and falls\n"
+"\tback, which only adds to start-up time.\n"
+"Reset SEQ lists line states r (RTS), d (DTR), rd (both) or - (none), each\n"
+"\toptionally held for :MS milliseconds. Use '--reset none' to skip reset.\n"
+"With --stream, HEX records must come in ascending page order, and pages\n"
+"\tnot in FILE are left intact.\n"
+"With --update, the chip on PORT must be the very one programmed last time.\n"
+"\tThe cache knows the chip model only, so with another chip pages may be\n"
+"\tleft unwritten. Without it, every page in FILE is written.\n"
+"With --erase and --update, ERASE_ALL is skipped if pages not in FILE are cached\n"
+"\tas blank. UPDATE_CONFIG is skipped if no CONFIG bit is to change.\n"
+"With --loop, reset SEQ is sent before the first board only. Next boards must\n"
+"\tstart LDROM at power-on.\n"
+"Hot-plug ATTR is looked up from tty up to USB device, e.g. '-m idVendor=0403'\n"
+"\tor '-m driver=cp210x'. ATTR alone must only exist.\n"
+"USB-serial latency is put back on exit, SIGINT, SIGTERM or SIGHUP, but stays\n"
+"\tas set after SIGKILL or if the adapter is unplugged during the session.\n",
         z_getprogname());
     exit(status);
 }
@@ -66,7 +156,22 @@ static void parse_args(int argc, char* argv[])
 
     static struct z_option lopts[] = {
         { "port", z_required_argument, NULL, 'p' },
+        { "baud", z_required_argument, NULL, 'b' },
+        { "reset", z_required_argument, NULL, 'r' },
+        { "latency", z_required_argument, NULL, 'L' },
+        { "connect-timeout", z_required_argument, NULL, 'T' },
         { "erase", z_no_argument, NULL, 'x' },
+        { "update", z_no_argument, NULL, 'u' },
+        { "full", z_no_argument, NULL, 'F' },
+        { "window", z_required_argument, NULL, 'w' },
+        { "retries", z_required_argument, NULL, 'R' },
+        { "verify", z_no_argument, NULL, 'V' },
+        { "dry-run", z_no_argument, NULL, 'N' },
+        { "stream", z_no_argument, NULL, 'S' },
+        { "loop", z_optional_argument, NULL, 'n' },
+        { "hotplug", z_no_argument, NULL, 'H' },
+        { "match", z_required_argument, NULL, 'm' },
+        { "stats", z_optional_argument, NULL, 's' },
         { "config", z_required_argument, NULL, 'c' },
         { "list-ports", z_no_argument, NULL, 'l' },
         { "help", z_no_argument, NULL, 'h' },
@@ -89,15 +194,63 @@ static void parse_args(int argc, char* argv[])
     };
 
     int c;
-    while ((c = z_getopt_long(argc, argv, "p:xc:lh", lopts, NULL)) != -1) {
+    while ((c = z_getopt_long(argc, argv, "p:b:r:L:T:xuFw:R:VNSn::Hm:s::c:lh", lopts,
+            NULL)) != -1) {
         switch (c) {
         case 'p':
-            free(opt.port);
-            opt.port = z_strdup(z_optarg);
+            add_ports(z_optarg);
+        break;
+        case 'b':
+            opt.baud = (z_strcasecmp(z_optarg, "auto") == 0) ? 0 :
+                strtoul(z_optarg, NULL, 0);
+        break;
+        case 'r':
+            parse_reset(z_optarg);
+        break;
+        case 'L':
+            opt.latency = strtoul(z_optarg, NULL, 0);
+        break;
+        case 'T':
+            opt.connect = strtoul(z_optarg, NULL, 0);
         break;
         case 'x':
             opt.erase = true;
         break;
+        case 'u':
+            opt.update = true;
+        break;
+        case 'F':
+            opt.full = true;
+        break;
+        case 'V':
+            opt.verify = true;
+        break;
+        case 'N':
+            opt.dry_run = true;
+        break;
+        case 'w':
+            opt.window = strtoul(z_optarg, NULL, 0);
+        break;
+        case 'R':
+            opt.retries = strtoul(z_optarg, NULL, 0);
+        break;
+        case 'S':
+            opt.stream = true;
+        break;
+        case 'n':
+            opt.loop = true;
+            opt.boards = z_optarg ? strtoul(z_optarg, NULL, 0) : 0;
+        break;
+        case 'H':
+            opt.hotplug = true;
+        break;
+        case 'm':
+            opt.match = (char**)z_realloc(opt.match, (opt.nmatch + 1) * sizeof(char*));
+            opt.match[opt.nmatch++] = z_strdup(z_optarg);
+        break;
+        case 's':
+            opt.stats = (z_optarg && z_strcasecmp(z_optarg, "json") == 0) ? 2 : 1;
+        break;
         case 'c':
             do {
                 char* subarg;
@@ -165,51 +318,464 @@ static void parse_args(int argc, char* argv[])
         opt.file = z_strdup(argv[z_optind]);
 }
 
-int main(int argc, char* argv[])
+// per-port session
+typedef struct {
+    const char* port;
+    const IHX* ihx;
+    FILE* stream;           // instead of ihx
+    bool verbose;
+    // results
+    bool opened, ok;
+    uint32_t did;
+    unsigned baud;
+    uint64_t usec, connect_usec;
+    unsigned boards, passed;    // --loop
+    // --stats, all boards
+    uint64_t phase[PHASE_MAX];  // us
+    size_t written;
+    uint64_t write_packets;
+    ISP_STATS stats;
+    int errnum;
+    char error[64];
+    CACHE cache;
+} SESSION;
+
+static bool fail(SESSION* s, int errnum, const char* fmt, ...)
 {
-    parse_args(argc, argv);
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(s->error, sizeof(s->error), fmt, args);
+    va_end(args);
+    s->errnum = errnum;
+    return false;
+}
 
-    // ISP connection
-    uint8_t data[ISP_DATA_SIZE];
-    intptr_t isp = ucomm_open(opt.port, 115200, 0x801/*8-N-1*/);
-    if (isp < 0) {
-        if (opt.port != NULL)
-            z_error(EXIT_FAILURE, errno, "ucomm_open(%s)", opt.port);
-        z_warnx("missing port name");
-        usage(EXIT_FAILURE);
+// add time since *mark to phase
+static void lap(SESSION* s, int phase, uint64_t* mark)
+{
+    uint64_t now = z_clock();
+    s->phase[phase] += now - *mark;
+    *mark = now;
+}
+
+enum { JOURNAL_USEC = 250000 };     // save cache at most this often while writing
+
+// pages of isp_write() acked so far
+typedef struct {
+    CACHE* cache;
+    const uint64_t* hash;   // new page hashes
+    size_t page, end;       // next page to mark, end of write
+    uint64_t saved;         // last cache_save()
+} JOURNAL;
+
+// mark acked pages as written, so interrupted upload resumes past them
+static void journal(void* ctx, uint32_t address)
+{
+    JOURNAL* j = (JOURNAL*)ctx;
+    CACHE* cache = j->cache;
+    // page is done once acked up to its end (or the end of write)
+    size_t done = (address < j->end) ? address / cache->psz
+        : (address + cache->psz - 1) / cache->psz;
+    done = min(done, cache->pages);
+    if (j->page >= done)
+        return;
+    for (; j->page < done; ++j->page)
+        cache->hash[j->page] = j->hash[j->page];
+
+    uint64_t now = z_clock();
+    if (now - j->saved >= JOURNAL_USEC) {
+        cache_save(cache);
+        j->saved = now;
     }
-    free(opt.port);
+}
 
-    // assert RTS then DTR (aka nodemcu reset)
-    ucomm_rts(isp, 1);
-    ucomm_dtr(isp, 1);
-    ucomm_rts(isp, 0);
-    ucomm_dtr(isp, 0);
+// isp_write() and keep cache up to date with acked pages
+// note: with verify, acked is not written until data sum matches
+static bool journal_write(ISP* isp, CACHE* cache, const uint64_t* hash,
+    size_t address, const uint8_t* data, size_t sz)
+{
+    JOURNAL j = { .cache = cache, .hash = hash, .page = address / cache->psz,
+        .end = address + sz, .saved = z_clock() };
+    isp->progress = isp->verify ? NULL : journal;
+    isp->ctx = &j;
+    bool ok = isp_write(isp, address, data, sz, opt.window);
+    isp->progress = NULL;
+    if (ok)
+        journal(&j, address + sz);
+    else {
+        int errnum = errno;
+        cache_save(cache);
+        errno = errnum;
+    }
+    return ok;
+}
+
+// pages for --stream
+typedef struct {
+    SESSION* s;
+    ISP* isp;
+    size_t psz, aprom;
+    uint64_t* hash;         // new page hashes
+    size_t total, skipped;
+} WRITER;
+
+// write n contiguous pages, skip blank (after erase) and unchanged ones
+static bool write_pages(WRITER* w, size_t address, const uint8_t* data, size_t n)
+{
+    CACHE* cache = &w->s->cache;
+    size_t psz = w->psz;
+    if (address + n * psz > w->aprom) {
+        errno = EFBIG;
+        return false;
+    }
+
+    size_t run = SIZE_MAX;  // first page to write
+    for (size_t i = 0; i <= n; ++i) {
+        bool write = false;
+        if (i < n) {
+            const uint8_t* page = &data[i * psz];
+            size_t j = 0;
+            while (opt.erase && j < psz && page[j] == 0xff)
+                ++j;
+            if (!opt.erase || j < psz) {
+                size_t index = (address + i * psz) / psz;
+                w->hash[index] = cache_hash(address + i * psz, page, psz);
+                write = (cache->hash[index] != w->hash[index] || opt.full);
+                if (write) {
+                    cache->hash[index] = 0;
+                    w->total += psz;
+                } else
+                    w->skipped += psz;
+            }
+        }
+
+        if (write && run == SIZE_MAX)
+            run = i;
+        else if (!write && run != SIZE_MAX) {
+            // pages being written are unknown until done
+            cache_save(cache);
+            if (!journal_write(w->isp, cache, w->hash, address + run * psz,
+                    &data[run * psz], (i - run) * psz))
+                return false;
+            run = SIZE_MAX;
+        }
+    }
+
+    return true;
+}
+
+#if defined(__unix__)
+enum { RING_PAGES = 64 };
+
+// pages on their way from reader thread to writer
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    IHX_STREAM st;
+    FILE* f;
+    size_t head, count;     // of RING_PAGES
+    size_t address[RING_PAGES];
+    uint8_t* data;          // RING_PAGES pages
+    bool done, cancel;
+    int fmt, errnum;
+} RING;
+
+static bool ring_put(void* ctx, size_t address, const uint8_t* data)
+{
+    RING* r = (RING*)ctx;
+    pthread_mutex_lock(&r->lock);
+    while (r->count == RING_PAGES && !r->cancel)
+        pthread_cond_wait(&r->cond, &r->lock);
+    bool ok = !r->cancel;
+    if (ok) {
+        size_t tail = (r->head + r->count) % RING_PAGES;
+        r->address[tail] = address;
+        memcpy(&r->data[tail * r->st.psz], data, r->st.psz);
+        ++r->count;
+        pthread_cond_broadcast(&r->cond);
+    }
+    pthread_mutex_unlock(&r->lock);
+    if (!ok)
+        errno = ECANCELED;
+    return ok;
+}
+
+static void* ring_reader(void* arg)
+{
+    RING* r = (RING*)arg;
+    int fmt = ihx_stream(&r->st, r->f);
+    int errnum = errno;
+    pthread_mutex_lock(&r->lock);
+    r->fmt = fmt;
+    r->errnum = errnum;
+    r->done = true;
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+    return NULL;
+}
+
+// wait for pages, return number of contiguous ones at head (0 if no more)
+static size_t ring_get(RING* r)
+{
+    pthread_mutex_lock(&r->lock);
+    while (r->count == 0 && !r->done)
+        pthread_cond_wait(&r->cond, &r->lock);
+    size_t n = 0;
+    while (n < r->count && r->head + n < RING_PAGES
+        && r->address[r->head + n] == r->address[r->head] + n * r->st.psz)
+        ++n;
+    pthread_mutex_unlock(&r->lock);
+    return n;
+}
+
+static void ring_release(RING* r, size_t n, bool cancel)
+{
+    pthread_mutex_lock(&r->lock);
+    r->head = (r->head + n) % RING_PAGES;
+    r->count -= n;
+    r->cancel = cancel;
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+}
+#else
+static bool write_page(void* ctx, size_t address, const uint8_t* data)
+{
+    return write_pages((WRITER*)ctx, address, data, 1);
+}
+#endif // __unix__
+
+// write pages while reading file
+static bool write_stream(SESSION* s, ISP* isp, size_t psz, size_t aprom)
+{
+    WRITER w = { .s = s, .isp = isp, .psz = psz, .aprom = aprom };
+    w.hash = (uint64_t*)z_malloc(s->cache.pages * sizeof(uint64_t));
+    memcpy(w.hash, s->cache.hash, s->cache.pages * sizeof(uint64_t));
+    bool ok = true;
+    int fmt, errnum = 0;
+    IHX_STREAM* st;
+
+#if defined(__unix__)
+    // parse on reader thread, write here
+    RING r = {
+        .st = { .psz = psz, .filler = 0xff, .page = ring_put },
+        .f = s->stream,
+    };
+    r.st.ctx = &r;
+    r.data = (uint8_t*)z_malloc(RING_PAGES * psz);
+    pthread_mutex_init(&r.lock, NULL);
+    pthread_cond_init(&r.cond, NULL);
+    pthread_t tid;
+    if ((errno = pthread_create(&tid, NULL, ring_reader, &r)) != 0)
+        z_error(EXIT_FAILURE, errno, "pthread_create");
+    for (size_t n; ok && (n = ring_get(&r)) > 0; ) {
+        ok = write_pages(&w, r.address[r.head], &r.data[r.head * psz], n);
+        errnum = errno;
+        ring_release(&r, n, !ok);
+    }
+    pthread_join(tid, NULL);
+    pthread_cond_destroy(&r.cond);
+    pthread_mutex_destroy(&r.lock);
+    free(r.data);
+    fmt = r.fmt;
+    if (ok)
+        errnum = r.errnum;
+    st = &r.st;
+#else
+    IHX_STREAM stream = { .psz = psz, .filler = 0xff, .page = write_page, .ctx = &w };
+    fmt = ihx_stream(&stream, s->stream);
+    errnum = errno;
+    st = &stream;
+#endif // __unix__
+
+    if (s->verbose) {
+        if (w.skipped > 0)
+            printf("Unchanged APROM[%zu]\n", w.skipped);
+        printf("Write APROM[%zu]\n", w.total);
+    }
+    s->written += w.total;
+    if (ok && fmt >= 0) {
+        memcpy(s->cache.hash, w.hash, s->cache.pages * sizeof(uint64_t));
+        cache_save(&s->cache);
+    }
+    free(w.hash);
+
+    if (!ok)
+        return fail(s, errnum, (errnum == EBADMSG) ? "verify(%zu)" : "isp_write(%zu)",
+            w.total);
+    if (fmt < 0)
+        return fail(s, errnum, "ihx_stream file=%s", opt.file);
+    if (st->entry > 0)
+        return fail(s, EFAULT, "ihx_stream entry=%#zx", st->entry);
+    return true;
+}
+
+// minimal ISP operations for the device as found
+typedef struct {
+    bool erase, config;
+    bool cached;            // skips anything as cached (--update only)
+    CONFIG merged;          // CONFIG to write
+    uint64_t* erased;       // page hashes after ERASE_ALL
+    uint64_t* hash;         // page hashes after write
+    IHX_EXTENT* changed;    // runs to write
+    size_t m, total, skipped;
+} PLAN;
+
+// plan by CONFIG read and pages cached as written
+// note: cache is all unknown here unless --update
+static bool make_plan(SESSION* s, PLAN* p, size_t aprom, const CONFIG* config)
+{
+    CACHE* cache = &s->cache;
+    memset(p, 0, sizeof(*p));
+
+    // CONFIG as merged with options, skip if no bit changes
+    p->merged = *config;
+#define MOVE_BIT(flag)                                  \
+    if (opt.config_flags & (1 << CONFIG_##flag))        \
+        p->merged.bit.flag = opt.config.bit.flag
+    MOVE_BIT(LOCK);
+    MOVE_BIT(RPD);
+    MOVE_BIT(OCDEN);
+    MOVE_BIT(OCDPWM);
+    MOVE_BIT(CBS);
+    MOVE_BIT(LDSIZE);
+    MOVE_BIT(CBORST);
+    MOVE_BIT(BOIAP);
+    MOVE_BIT(CBOV);
+    MOVE_BIT(CBODEN);
+    MOVE_BIT(WDTEN);
+    p->config = (memcmp(p->merged.raw, config->raw, sizeof(CONFIG)) != 0);
+
+    const IHX* ihx = s->ihx;
+    IHX_EXTENT* runs = NULL;
+    size_t n = 0;
+    if (s->stream == NULL && opt.file != NULL) {
+        if (ihx->sz > aprom)
+            return fail(s, EFBIG, "ihx_load sz=%#zx", ihx->sz);
+        // erased pages are blank already
+        n = opt.erase ? page_runs(ihx, cache->psz, &runs) : whole_run(ihx, &runs);
+    }
+
+    // page hashes as if blank
+    p->erased = (uint64_t*)z_malloc(cache->pages * sizeof(uint64_t));
+    uint8_t* blank = (uint8_t*)memset(z_malloc(cache->psz), 0xff, cache->psz);
+    for (size_t i = 0; i < cache->pages; ++i)
+        p->erased[i] = cache_hash(i * cache->psz, blank, cache->psz);
+    free(blank);
+
+    // UPDATE_APROM erases every page it writes, so ERASE_ALL is only needed
+    // to blank other pages not known to be blank yet
+    if (opt.erase) {
+        p->erase = (opt.full || s->stream != NULL);
+        for (size_t i = 0, j = 0; i < cache->pages && !p->erase; ++i) {
+            size_t lo = i * cache->psz;
+            while (j < n && runs[j].address + runs[j].sz <= lo)
+                ++j;
+            bool written = (j < n && runs[j].address < lo + cache->psz);
+            if (!written) {
+                p->erase = (cache->hash[i] != p->erased[i]);
+                p->cached = true;
+            }
+        }
+    }
+
+    // skip pages unchanged since the last write (or erase)
+    CACHE after = *cache;
+    after.hash = p->erased;
+    CACHE* base = p->erase ? &after : cache;
+    p->hash = (uint64_t*)z_malloc(cache->pages * sizeof(uint64_t));
+    memcpy(p->hash, base->hash, cache->pages * sizeof(uint64_t));
+    p->m = diff_runs(ihx, base, p->hash, runs, n, &p->changed);
+    for (size_t i = 0; i < n; ++i)
+        p->skipped += runs[i].sz;
+    for (size_t i = 0; i < p->m; ++i)
+        p->total += p->changed[i].sz;
+    p->skipped -= p->total;
+    p->cached = (p->cached && !p->erase) || p->skipped > 0;
+    free(runs);
+    return true;
+}
+
+static void free_plan(PLAN* p)
+{
+    free(p->changed);
+    free(p->hash);
+    free(p->erased);
+}
+
+// --dry-run
+static void print_plan(const SESSION* s, const PLAN* p)
+{
+    char write[64] = "no";
+    if (s->stream != NULL)
+        strcpy(write, "as read");
+    else if (opt.file != NULL)
+        snprintf(write, sizeof(write), "%zu bytes in %zu runs (%zu unchanged)",
+            p->total, p->m, p->skipped);
+    // single printf as ganged ports report at once
+    printf("%s: ERASE_ALL %s, UPDATE_APROM %s, UPDATE_CONFIG %s%s\n",
+        s->port ? s->port : "-", p->erase ? "yes" : "no", write,
+        p->config ? "yes" : "no", p->cached ? " (by cache, same chip assumed)" : "");
+    fflush(stdout);
+}
+
+static bool program(SESSION* s, ISP* isp)
+{
+    uint8_t data[ISP_DATA_SIZE];
+    uint64_t mark = z_clock();
+    isp->retries = opt.retries;
+    isp->page = 0;
+    isp->verify = opt.verify;
+
+    // reset target (next boards would rather restart the one just done)
+    for (size_t i = 0; i < opt.nreset && s->boards == 0; ++i) {
+        ucomm_modem(isp->fd, opt.reset[i].lines & RESET_DTR,
+            opt.reset[i].lines & RESET_RTS);
+        if (opt.reset[i].ms > 0)
+            z_delay(opt.reset[i].ms);
+    }
 
     // wait for connect
-    puts("Wait for connection...");
-    do {
-        // ISP_CONNECT
-    } while (!isp_command(ISP_CONNECT, data, isp));
-    ucomm_purge(isp);
+    if (s->verbose)
+        puts("Wait for connection...");
+    // listen for one packet time (10 bits per byte) plus LDROM turnaround
+    lap(s, PHASE_RESET, &mark);
+    unsigned gap = ISP_PACKET_SIZE * 10 * 1000000ull / s->baud
+        + ISP_TURNAROUND * 1000;
+    // give up on a silent port, but boards to come are waited for
+    uint64_t deadline = (opt.connect > 0 && !opt.loop && !opt.hotplug)
+        ? z_clock() + opt.connect * 1000ull : 0;
+    bool connected = isp_connect(isp, gap, deadline);
+    s->connect_usec = z_clock() - mark;
+    lap(s, PHASE_CONNECT, &mark);
+    if (!connected)
+        return fail(s, errno, "CONNECT failed");
+    if (s->verbose)
+        printf("Connected in %" PRIu64 " ms\n", s->connect_usec / 1000);
 
     // Chip Info
-    uint32_t did;
     size_t fsz, psz, ldsz;
     uint8_t fw_version;
     CONFIG config;
 
 #define ISP(code)                                       \
-    if (!isp_command(ISP_##code, data, isp))            \
-        z_error(EXIT_FAILURE, errno, "%s failed", #code)
+    if (!isp_request(isp, ISP_##code, data))            \
+        return fail(s, errno, "%s failed", #code)
+
+    // find the fastest rate that passes
+    if (opt.baud == 0) {
+        s->baud = isp_autobaud(isp, 115200);
+        if (s->verbose)
+            printf("Baud Rate: %u\n", s->baud);
+    }
 
     // may be required by bootloader
     ISP(SYNC_PACKNO);
 
     ISP(GET_DEVICEID);
-    did = (data[1] << 8) | (data[0]);
-    fsz = nuvoton_flashsize(did);
-    psz = nuvoton_pagesize(did);
+    s->did = (data[1] << 8) | (data[0]);
+    fsz = nuvoton_flashsize(s->did);
+    psz = nuvoton_pagesize(s->did);
+    isp->page = psz;
 
     ISP(GET_FWVER);
     fw_version = data[0];
@@ -218,72 +784,681 @@ int main(int argc, char* argv[])
     memcpy(config.raw, data, sizeof(CONFIG));
     ldsz = nuvoton_ldromsize(config.bit.LDSIZE);
 
-    printf("Device ID: %#x\n", did);
-    printf("Flash Memory: %zuKB,%zup,x%zu\n", fsz / 1024, fsz / psz, psz);
-    printf("FW Version: %#x\n", fw_version);
-    print_config(&config);
+    if (s->verbose) {
+        printf("Device ID: %#x\n", s->did);
+        printf("Flash Memory: %zuKB,%zup,x%zu\n", fsz / 1024, fsz / psz, psz);
+        printf("FW Version: %#x\n", fw_version);
+        print_config(&config);
+    }
 
-    // Erase
-    if (opt.erase) {
-        ucomm_timeout(isp, 3000);
-        puts("Erase APROM");
-        ISP(ERASE_ALL);
-        ucomm_timeout(isp, UCOMM_DEFAULT_TIMEOUT);
+    cache_open(&s->cache, s->port, s->did, psz, fsz - ldsz);
+    // chip ID is per model, so unless told the chip is the same, it may hold anything
+    if (!opt.update || opt.loop || opt.hotplug)
+        memset(s->cache.hash, 0, s->cache.pages * sizeof(uint64_t));
+
+    // Plan
+    PLAN plan;
+    if (!make_plan(s, &plan, fsz - ldsz, &config))
+        return false;
+    lap(s, PHASE_INFO, &mark);
+    if (opt.dry_run) {
+        print_plan(s, &plan);
+        if (s->verbose && plan.config)
+            print_config(&plan.merged);
+        free_plan(&plan);
+        ISP(RUN_APROM);
+        return true;
     }
 
+    // Erase
+    if (plan.erase) {
+        // nothing is known during erase, all is blank after
+        memset(s->cache.hash, 0, s->cache.pages * sizeof(uint64_t));
+        cache_save(&s->cache);
+        isp->timeout = ISP_ERASE_TIMEOUT;
+        if (s->verbose)
+            puts("Erase APROM");
+        bool ok = isp_request(isp, ISP_ERASE_ALL, data);
+        isp->timeout = UCOMM_DEFAULT_TIMEOUT;
+        if (!ok) {
+            fail(s, errno, "ERASE_ALL failed");
+            free_plan(&plan);
+            return false;
+        }
+        memcpy(s->cache.hash, plan.erased, s->cache.pages * sizeof(uint64_t));
+        cache_save(&s->cache);
+    } else if (opt.erase && s->verbose)
+        puts("Erase APROM: not needed");
+    lap(s, PHASE_ERASE, &mark);
+
     // Write
-    if (opt.file != NULL) {
+    uint64_t packets = s->stats.packets;
+    bool ok = true;
+    if (s->stream != NULL)
+        ok = write_stream(s, isp, psz, fsz - ldsz);
+    else if (opt.file != NULL) {
+        const IHX* ihx = s->ihx;
+        if (s->verbose) {
+            if (plan.skipped > 0)
+                printf("Unchanged APROM[%zu]\n", plan.skipped);
+            printf("Write APROM[%zu]\n", plan.total);
+        }
+        s->written += plan.total;
+        // pages being written are unknown until done
+        if (plan.m > 0)
+            cache_save(&s->cache);
+        for (size_t i = 0; ok && i < plan.m; ++i)
+            ok = journal_write(isp, &s->cache, plan.hash, plan.changed[i].address,
+                &ihx->image[plan.changed[i].address - ihx->base], plan.changed[i].sz);
+        if (ok) {
+            memcpy(s->cache.hash, plan.hash, s->cache.pages * sizeof(uint64_t));
+            cache_save(&s->cache);
+        } else
+            fail(s, errno, (errno == EBADMSG) ? "verify(%zu)" : "isp_write(%zu)",
+                plan.total);
+    }
+    free_plan(&plan);
+    if (!ok)
+        return false;
+    s->write_packets += s->stats.packets - packets;
+    lap(s, PHASE_WRITE, &mark);
+
+    // CONFIG
+    if (plan.config) {
+        memcpy(data, plan.merged.raw, sizeof(CONFIG));
+        if (s->verbose)
+            puts("Update CONFIG");
+        ISP(UPDATE_CONFIG);
+    } else if (opt.config_flags != 0 && s->verbose)
+        puts("Unchanged CONFIG");
+    lap(s, PHASE_CONFIG, &mark);
+
+    ISP(RUN_APROM);
+    return true;
+}
+
+// print --loop or --hotplug result of one board
+static void report(const SESSION* s, uint64_t usec)
+{
+    char buf[128] = "";
+    if (!s->ok && z_strerror_r(s->errnum, buf + 2, sizeof(buf) - 2) == 0)
+        memcpy(buf, ": ", 2);
+    char board[32] = "";
+    if (s->boards > 0)
+        snprintf(board, sizeof(board), " board %u", s->boards);
+    // single printf as ganged ports report at once
+    printf("%s:%s in %" PRIu64 " ms (wait %" PRIu64 " ms): %s%s\n",
+        s->port ? s->port : "-", board, (usec - s->connect_usec) / 1000,
+        s->connect_usec / 1000, s->ok ? "OK" : s->error, s->ok ? "" : buf);
+    fflush(stdout);
+}
+
+// keep port open, program board after board
+static void loop(SESSION* s, ISP* isp, uint64_t start)
+{
+    unsigned baud = s->baud;
+    bool verbose = s->verbose;
+    s->verbose = false;     // chip info is printed once
+
+    for (;;) {
+        ++s->boards;
+        s->passed += s->ok;
+        report(s, z_clock() - start);
+        // port is gone
+        if (!s->ok && (s->errnum == EIO || s->errnum == ENXIO || s->errnum == ENODEV))
+            break;
+        if (opt.boards != 0 && s->boards >= opt.boards)
+            break;
+
+        // back to CONNECT at the initial rate
+        if (s->baud != baud) {
+            ucomm_reset(isp->fd, baud, 0x801/*8-N-1*/);
+            s->baud = baud;
+        }
+        ucomm_frame(isp->fd, 0);
+        ucomm_purge(isp->fd);
+        if (verbose)
+            puts("Wait for next board...");
+        start = z_clock();
+        s->connect_usec = 0;
+        s->ok = program(s, isp);
+        cache_close(&s->cache);
+    }
+
+    s->ok = (s->passed == s->boards);
+    if (!s->ok && s->passed > 0)
+        fail(s, s->errnum, "%u of %u boards failed", s->boards - s->passed, s->boards);
+}
+
+// USB-serial settings changed for session
+typedef struct RESTORE {
+    struct RESTORE* next;
+    intptr_t fd;
+    int latency, low;       // previous values, -1 if not changed
+} RESTORE;
+
+#if defined(__unix__)
+// ports to restore if killed
+static RESTORE* restore_list;
+static pthread_mutex_t restore_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static void restore(const RESTORE* r)
+{
+    if (r->latency >= 0)
+        ucomm_latency(r->fd, r->latency);
+    if (r->low >= 0)
+        ucomm_low_latency(r->fd, r->low);
+}
+
+// lower USB-serial latency for the session
+static void tune_port(RESTORE* r, intptr_t fd)
+{
+    *r = (RESTORE){ .fd = fd, .latency = -1, .low = -1 };
+    if (opt.latency == 0)
+        return;
+#if defined(__unix__)
+    pthread_mutex_lock(&restore_lock);
+#endif
+    int latency = ucomm_latency(fd, opt.latency);
+    int low = ucomm_low_latency(fd, opt.latency == 1);
+    if (latency >= 0 && (unsigned)latency != opt.latency)
+        r->latency = latency;
+    if (low >= 0 && low != (opt.latency == 1))
+        r->low = low;
+#if defined(__unix__)
+    r->next = restore_list;
+    restore_list = r;
+    pthread_mutex_unlock(&restore_lock);
+#endif
+}
+
+// put back what tune_port() has changed
+static void restore_port(RESTORE* r)
+{
+#if defined(__unix__)
+    pthread_mutex_lock(&restore_lock);
+    for (RESTORE** p = &restore_list; *p != NULL; p = &(*p)->next)
+        if (*p == r) {
+            *p = r->next;
+            break;
+        }
+#endif
+    restore(r);
+#if defined(__unix__)
+    pthread_mutex_unlock(&restore_lock);
+#endif
+}
+
+#if defined(__unix__)
+// restore all ports, then die of the same signal
+static void* restore_on_signal(void* arg)
+{
+    sigset_t* set = (sigset_t*)arg;
+    int sig;
+    while (sigwait(set, &sig) != 0)
+        ;
+    pthread_mutex_lock(&restore_lock);
+    for (RESTORE* r = restore_list; r != NULL; r = r->next)
+        restore(r);
+    signal(sig, SIG_DFL);
+    pthread_sigmask(SIG_UNBLOCK, set, NULL);
+    raise(sig);
+    return NULL;
+}
+
+// catch SIGINT, SIGTERM and SIGHUP in a thread of their own
+static void restore_init(void)
+{
+    static sigset_t set;
+    sigemptyset(&set);
+    static const int signals[] = { SIGINT, SIGTERM, SIGHUP };
+    for (size_t i = 0; i < sizeof(signals) / sizeof(signals[0]); ++i) {
+        struct sigaction sa;
+        // keep ignoring what we were told to, e.g. by nohup
+        if (sigaction(signals[i], NULL, &sa) == 0 && sa.sa_handler != SIG_IGN)
+            sigaddset(&set, signals[i]);
+    }
+    // blocked in all threads to come, so sigwait() gets them
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    pthread_t thread;
+    if ((errno = pthread_create(&thread, NULL, restore_on_signal, &set)) != 0)
+        z_error(EXIT_FAILURE, errno, "pthread_create");
+    pthread_detach(thread);
+}
+#endif // __unix__
+
+static void* session(void* arg)
+{
+    SESSION* s = (SESSION*)arg;
+    uint64_t start = z_clock();
+
+    s->baud = opt.baud ? opt.baud : 115200;
+    ISP isp = { .fd = ucomm_open(s->port, s->baud, 0x801/*8-N-1*/), .packno = 1,
+        .timeout = UCOMM_DEFAULT_TIMEOUT, .stats = opt.stats ? &s->stats : NULL };
+    s->opened = (isp.fd >= 0);
+    if (!s->opened)
+        fail(s, errno, "ucomm_open(%s)", s->port ? s->port : "");
+    else {
+        RESTORE r;
+        tune_port(&r, isp.fd);
+        if (r.latency >= 0 && s->verbose)
+            printf("Latency Timer: %d -> %u ms\n", r.latency, opt.latency);
+        if (r.low >= 0 && s->verbose)
+            printf("Low Latency Flag: %s\n", r.low ? "cleared" : "set");
+        s->ok = program(s, &isp);
+        cache_close(&s->cache);
+        if (opt.loop)
+            loop(s, &isp, start);
+        restore_port(&r);
+        ucomm_close(isp.fd);
+    }
+
+    s->usec = z_clock() - start;
+    return NULL;
+}
+
+// run all sessions in parallel
+static void gang(SESSION* sessions, size_t n)
+{
+#if defined(__unix__)
+    pthread_t* threads = (pthread_t*)z_malloc(n * sizeof(pthread_t));
+    for (size_t i = 0; i < n; ++i)
+        if ((errno = pthread_create(&threads[i], NULL, session, &sessions[i])) != 0)
+            z_error(EXIT_FAILURE, errno, "pthread_create");
+    for (size_t i = 0; i < n; ++i)
+        pthread_join(threads[i], NULL);
+    free(threads);
+#else
+    for (size_t i = 0; i < n; ++i)
+        session(&sessions[i]);
+#endif
+}
+
+static void print_summary(const SESSION* sessions, size_t n)
+{
+    size_t passed = 0;
+    printf("\n%-24s %-8s %8s %11s %10s  %s\n", "Port", "Device", "Baud",
+        "Connect, ms", "Time, ms", "Result");
+    for (size_t i = 0; i < n; ++i) {
+        const SESSION* s = &sessions[i];
+        char did[16] = "-";
+        if (s->did != 0)
+            snprintf(did, sizeof(did), "%#x", s->did);
+        printf("%-24s %-8s %8u %11" PRIu64 " %10" PRIu64 "  ", s->port, did, s->baud,
+            s->connect_usec / 1000, s->usec / 1000);
+        if (opt.loop)
+            printf("%u/%u ", s->passed, s->boards);
+        if (s->ok) {
+            puts("OK");
+            ++passed;
+        } else {
+            char buf[128];
+            if (z_strerror_r(s->errnum, buf, sizeof(buf)) == 0)
+                printf("%s: %s\n", s->error, buf);
+            else
+                puts(s->error);
+        }
+    }
+    printf("%zu of %zu passed\n", passed, n);
+}
+
+// append to string
+static void cat(char* buf, size_t sz, const char* fmt, ...)
+{
+    size_t len = strlen(buf);
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(&buf[len], sz - len, fmt, args);
+    va_end(args);
+}
+
+// --stats report, single write as sessions may end at once
+static void print_stats(const SESSION* s)
+{
+    const ISP_STATS* st = &s->stats;
+    double write_s = s->phase[PHASE_WRITE] / 1e6;
+    double bps = (write_s > 0) ? s->written / write_s : 0;
+    double pps = (write_s > 0) ? s->write_packets / write_s : 0;
+    uint64_t avg = st->packets ? st->rtt_sum / st->packets : 0;
+    uint64_t top = 1;
+    for (size_t i = 0; i < ISP_RTT_BINS; ++i)
+        top = max(top, st->rtt[i]);
+    char buf[4096] = "";
+
+    if (opt.stats > 1) {
+        // no quotes or backslashes in port
+        char port[128] = "";
+        const char* p = s->port ? s->port : "-";
+        for (; *p && strlen(port) + 1 < sizeof(port); ++p)
+            cat(port, sizeof(port), "%c", (*p == '"' || *p == '\\') ? '_' : *p);
+        cat(buf, sizeof(buf), "{\"port\":\"%s\",\"ok\":%s,\"phases_ms\":{", port,
+            s->ok ? "true" : "false");
+        for (size_t i = 0; i < PHASE_MAX; ++i)
+            cat(buf, sizeof(buf), "%s\"%s\":%.3f", i ? "," : "", phase_names[i],
+                s->phase[i] / 1e3);
+        cat(buf, sizeof(buf), "},\"written\":%zu,\"write_packets\":%" PRIu64
+            ",\"bytes_per_s\":%.1f,\"packets_per_s\":%.1f,\"packets\":%" PRIu64
+            ",\"bytes_tx\":%" PRIu64 ",\"bytes_rx\":%" PRIu64 ",\"rtt_us\":{\"avg\":%"
+            PRIu64 ",\"max\":%" PRIu64 ",\"hist\":[", s->written, s->write_packets, bps,
+            pps, st->packets, st->bytes_tx, st->bytes_rx, avg, st->rtt_max);
+        bool comma = false;
+        for (size_t i = 0; i < ISP_RTT_BINS; ++i)
+            if (st->rtt[i] > 0) {
+                cat(buf, sizeof(buf), "%s[%lu,%" PRIu64 "]", comma ? "," : "",
+                    1ul << i, st->rtt[i]);
+                comma = true;
+            }
+        cat(buf, sizeof(buf), "]},\"mismatches\":%u,\"timeouts\":%u,\"resyncs\":%u}\n",
+            st->mismatches, st->timeouts, st->resyncs);
+    } else {
+        cat(buf, sizeof(buf), "Stats for %s\nPhases, ms:", s->port ? s->port : "-");
+        for (size_t i = 0; i < PHASE_MAX; ++i)
+            cat(buf, sizeof(buf), "%s %s %.1f", i ? "," : "", phase_names[i],
+                s->phase[i] / 1e3);
+        cat(buf, sizeof(buf), "\nWrite: %zu bytes, %" PRIu64 " packets in %.1f ms"
+            " (%.0f B/s, %.1f packets/s)\n", s->written, s->write_packets,
+            write_s * 1e3, bps, pps);
+        cat(buf, sizeof(buf), "Round trip, us: avg %" PRIu64 ", max %" PRIu64 "\n",
+            avg, st->rtt_max);
+        for (size_t i = 0; i < ISP_RTT_BINS; ++i)
+            if (st->rtt[i] > 0)
+                cat(buf, sizeof(buf), "%10lu..%-8lu %8" PRIu64 " %.*s\n", 1ul << i,
+                    (2ul << i) - 1, st->rtt[i], (int)(st->rtt[i] * 40 / top),
+                    "########################################");
+        cat(buf, sizeof(buf), "Errors: %u checksum mismatches, %u timeouts, %u resyncs\n",
+            st->mismatches, st->timeouts, st->resyncs);
+    }
+
+    fputs(buf, stdout);
+    fflush(stdout);
+}
+
+#if defined(__unix__)
+// test port against --match
+static bool match_port(const char* port)
+{
+    for (size_t i = 0; i < opt.nmatch; ++i) {
+        char attr[64], value[256];
+        const char* eq = strchr(opt.match[i], '=');
+        size_t len = eq ? (size_t)(eq - opt.match[i]) : strlen(opt.match[i]);
+        if (len >= sizeof(attr))
+            return false;
+        memcpy(attr, opt.match[i], len);
+        attr[len] = 0;
+        if (ucomm_port_attr(port, attr, value, sizeof(value)) < 0
+            || (eq != NULL && fnmatch(eq + 1, value, 0) != 0))
+            return false;
+    }
+    return true;
+}
+
+static void* hotplug_session(void* arg)
+{
+    SESSION* s = (SESSION*)arg;
+    session(s);
+    if (!opt.loop)
+        report(s, s->usec);
+    if (opt.stats)
+        print_stats(s);
+    free((char*)s->port);
+    free(s);
+    return NULL;
+}
+
+// start session for every new port
+/*noreturn*/
+static void hotplug(const IHX* ihx)
+{
+    intptr_t wd = ucomm_watch_open();
+    if (wd < 0)
+        z_error(EXIT_FAILURE, errno, "ucomm_watch_open");
+    puts("Wait for ports...");
+    fflush(stdout);
+
+    for (;;) {
+        char** ports;
+        ssize_t n = ucomm_watch(wd, &ports, 0);
+        if (n < 0)
+            z_error(EXIT_FAILURE, errno, "ucomm_watch");
+        for (ssize_t i = 0; i < n; ++i) {
+            if (!match_port(ports[i]))
+                continue;
+            SESSION* s = (SESSION*)z_malloc(sizeof(SESSION));
+            *s = (SESSION){ .port = z_strdup(ports[i]), .ihx = ihx };
+            pthread_t thread;
+            if ((errno = pthread_create(&thread, NULL, hotplug_session, s)) != 0)
+                z_error(EXIT_FAILURE, errno, "pthread_create");
+            pthread_detach(thread);
+        }
+        free(ports);
+    }
+}
+#endif // __unix__
+
+int main(int argc, char* argv[])
+{
+    parse_args(argc, argv);
+
+    if (opt.stream && (opt.file == NULL || opt.nports > 1 || opt.loop)) {
+        z_warnx("--stream needs FILE and single port, no --loop");
+        usage(EXIT_FAILURE);
+    }
+    if (opt.hotplug && (opt.nports > 0 || opt.stream)) {
+        z_warnx("--hotplug takes no --port or --stream");
+        usage(EXIT_FAILURE);
+    }
+
+#if defined(__unix__)
+    restore_init();
+#endif
+
+    // load image once
+    IHX ihx = {0};
+    FILE* stream = NULL;
+    if (opt.stream)
+        stream = z_fopen(opt.file, "rb");
+    else if (opt.file != NULL) {
         FILE* fin = z_fopen(opt.file, "rb");
-        IHX ihx;
         if (ihx_load(&ihx, 0xff, fin) < 0)
             z_error(EXIT_FAILURE, errno, "ihx_load file=%s", opt.file);
         if (ihx.entry > 0)
             z_error(EXIT_FAILURE, EFAULT, "ihx_load entry=%#zx", ihx.entry);
-        if (ihx.sz > fsz - ldsz)
-            z_error(EXIT_FAILURE, EFBIG, "ihx_load sz=%#zx", ihx.sz);
+        fclose(fin);
+    }
 
-        printf("Write APROM[%zu]\n", ihx.sz);
-        if (!isp_write(ihx.base, ihx.image, ihx.sz, isp))
-            z_error(EXIT_FAILURE, errno, "isp_write(%zu)", ihx.sz);
+    if (opt.hotplug) {
+#if defined(__unix__)
+        hotplug(&ihx);
+#else
+        z_error(EXIT_FAILURE, ENOSYS, "--hotplug");
+#endif
+    }
 
-        free(ihx.image);
-        fclose(fin);
+    size_t n = max(opt.nports, 1);
+    SESSION* sessions = (SESSION*)z_malloc(n * sizeof(SESSION));
+    for (size_t i = 0; i < n; ++i)
+        sessions[i] = (SESSION){
+            .port = opt.nports ? opt.ports[i] : NULL,
+            .ihx = &ihx,
+            .stream = stream,
+            .verbose = (n == 1),
+        };
+
+    bool ok = true;
+    if (n == 1) {
+        session(&sessions[0]);
+        if (!sessions[0].opened && sessions[0].port == NULL) {
+            z_warnx("missing port name");
+            usage(EXIT_FAILURE);
+        }
+        if (opt.stats && sessions[0].opened)
+            print_stats(&sessions[0]);
+        if (!sessions[0].ok)
+            z_error(EXIT_FAILURE, sessions[0].errnum, "%s", sessions[0].error);
+    } else {
+        puts("Wait for connection...");
+        gang(sessions, n);
+        print_summary(sessions, n);
+        for (size_t i = 0; i < n && opt.stats; ++i)
+            if (sessions[i].opened)
+                print_stats(&sessions[i]);
+        for (size_t i = 0; i < n; ++i)
+            ok = ok && sessions[i].ok;
     }
 
-    // CONFIG
-    if (opt.config_flags != 0) {
-#define MOVE_BIT(flag)                                  \
-        if (opt.config_flags & (1 << CONFIG_##flag))    \
-            config.bit.flag = opt.config.bit.flag
-        MOVE_BIT(LOCK);
-        MOVE_BIT(RPD);
-        MOVE_BIT(OCDEN);
-        MOVE_BIT(OCDPWM);
-        MOVE_BIT(CBS);
-        MOVE_BIT(LDSIZE);
-        MOVE_BIT(CBORST);
-        MOVE_BIT(BOIAP);
-        MOVE_BIT(CBOV);
-        MOVE_BIT(CBODEN);
-        MOVE_BIT(WDTEN);
-        memcpy(data, config.raw, sizeof(CONFIG));
-        puts("Update CONFIG");
-        ISP(UPDATE_CONFIG);
+    for (size_t i = 0; i < opt.nports; ++i)
+        free(opt.ports[i]);
+    free(opt.ports);
+    free(sessions);
+    ihx_free(&ihx);
+    if (stream != NULL)
+        fclose(stream);
+    exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+void add_ports(const char* pattern)
+{
+#if defined(__unix__)
+    glob_t g;
+    if (glob(pattern, 0, NULL, &g) == 0) {
+        opt.ports = (char**)z_realloc(opt.ports,
+            (opt.nports + g.gl_pathc) * sizeof(char*));
+        for (size_t i = 0; i < g.gl_pathc; ++i)
+            opt.ports[opt.nports++] = z_strdup(g.gl_pathv[i]);
+        globfree(&g);
+        return;
     }
+#endif
+    opt.ports = (char**)z_realloc(opt.ports, (opt.nports + 1) * sizeof(char*));
+    opt.ports[opt.nports++] = z_strdup(pattern);
+}
 
-    ISP(RUN_APROM);
-    ucomm_close(isp);
-    exit(EXIT_SUCCESS);
+// r,rd:10,d,- => RTS, RTS+DTR for 10 ms, DTR, none
+void parse_reset(const char* seq)
+{
+    opt.nreset = 0;
+    if (z_strcasecmp(seq, "none") == 0)
+        return;
+
+    for (;;) {
+        if (opt.nreset >= RESET_MAX)
+            z_error(EXIT_FAILURE, E2BIG, "reset=%s", seq);
+        unsigned lines = 0;
+        for (; *seq != 0 && *seq != ':' && *seq != ','; ++seq) {
+            switch (tolower((unsigned char)*seq)) {
+            case 'd': lines |= RESET_DTR; break;
+            case 'r': lines |= RESET_RTS; break;
+            case '-': break;
+            default: z_error(EXIT_FAILURE, EINVAL, "reset=%s", seq);
+            }
+        }
+        unsigned ms = 0;
+        if (*seq == ':')
+            ms = strtoul(seq + 1, (char**)&seq, 10);
+        opt.reset[opt.nreset].lines = lines;
+        opt.reset[opt.nreset++].ms = ms;
+        if (*seq == 0)
+            break;
+        if (*seq++ != ',')
+            z_error(EXIT_FAILURE, EINVAL, "reset=%s", seq - 1);
+    }
 }
 
 void list_ports(void)
 {
-    char** ports;
-    size_t n = ucomm_ports(&ports);
-    for (size_t i = 0; i < n; ++i)
-        puts(ports[i]);
+    struct ucomm_port* info;
+    size_t n = ucomm_ports_info(&info);
+    for (size_t i = 0; i < n; ++i) {
+        char usb[16] = "-";
+        if (info[i].vid != 0)
+            snprintf(usb, sizeof(usb), "%04x:%04x", info[i].vid, info[i].pid);
+        printf("%-24s %-9s %-12s %s\n", info[i].port, usb,
+            *info[i].driver ? info[i].driver : "-", info[i].serial);
+    }
     printf("%zu ports found\n", n);
-    free(ports);
+    free(info);
+}
+
+// page-aligned runs of IHX holding non-blank data
+size_t page_runs(const IHX* ihx, size_t psz, IHX_EXTENT** runs)
+{
+    size_t n = 0, page = 0, end = ihx->base + ihx->sz;
+    *runs = NULL;
+
+    for (size_t i = 0; i < ihx->extents; ++i) {
+        const IHX_EXTENT* e = &ihx->extent[i];
+        // pages past end of previous extent only
+        page = max(page, e->address & ~(psz - 1));
+        for (; page < e->address + e->sz; page += psz) {
+            size_t lo = max(page, ihx->base), hi = min(page + psz, end);
+            size_t j = lo;
+            while (j < hi && ihx->image[j - ihx->base] == 0xff)
+                ++j;
+            if (j == hi)
+                continue;
+
+            if (n > 0 && (*runs)[n - 1].address + (*runs)[n - 1].sz == lo) {
+                (*runs)[n - 1].sz += hi - lo;
+            } else {
+                *runs = (IHX_EXTENT*)z_realloc(*runs, (n + 1) * sizeof(IHX_EXTENT));
+                (*runs)[n].address = lo;
+                (*runs)[n++].sz = hi - lo;
+            }
+        }
+    }
+
+    return n;
+}
+
+// [base, base + sz) as one run
+size_t whole_run(const IHX* ihx, IHX_EXTENT** runs)
+{
+    *runs = (IHX_EXTENT*)z_malloc(sizeof(IHX_EXTENT));
+    (*runs)->address = ihx->base;
+    (*runs)->sz = ihx->sz;
+    return 1;
+}
+
+// split runs into pages, keep those changed since cached write (or all if --full)
+// new page hashes go to hash[], the cache forgets pages to be written
+// note: hash whole page as it is after write (padded with 0xff), same as --stream
+size_t diff_runs(const IHX* ihx, CACHE* cache, uint64_t* hash,
+    const IHX_EXTENT* runs, size_t n, IHX_EXTENT** changed)
+{
+    size_t m = 0;
+    *changed = NULL;
+    uint8_t* buf = (uint8_t*)z_malloc(cache->psz);
+
+    for (size_t i = 0; i < n; ++i) {
+        size_t end = runs[i].address + runs[i].sz;
+        for (size_t lo = runs[i].address, hi; lo < end; lo = hi) {
+            size_t page = lo / cache->psz;
+            hi = min((page + 1) * cache->psz, end);
+            memset(buf, 0xff, cache->psz);
+            memcpy(&buf[lo - page * cache->psz], &ihx->image[lo - ihx->base], hi - lo);
+            uint64_t h = cache_hash(page * cache->psz, buf, cache->psz);
+            if (page < cache->pages) {
+                bool same = (cache->hash[page] == h);
+                hash[page] = h;
+                if (same && !opt.full)
+                    continue;
+                cache->hash[page] = 0;
+            }
+
+            if (m > 0 && (*changed)[m - 1].address + (*changed)[m - 1].sz == lo) {
+                (*changed)[m - 1].sz += hi - lo;
+            } else {
+                *changed = (IHX_EXTENT*)z_realloc(*changed,
+                    (m + 1) * sizeof(IHX_EXTENT));
+                (*changed)[m].address = lo;
+                (*changed)[m++].sz = hi - lo;
+            }
+        }
+    }
+
+    free(buf);
+    return m;
 }
 
 // Nuvoton ID => Flash Size
@@ -1,9 +1,13 @@
+#if defined(__unix__) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
 #include "stdz.h"
 #if defined(_WIN32)
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
 #elif defined(__unix__)
 #include <sys/select.h>
+#include <time.h>
 #endif
 
 static const char* _z_progname = "stdz";
@@ -281,6 +285,22 @@ void z_delay(uint32_t ms)
 #endif
 }
 
+// monotonic clock (microseconds)
+uint64_t z_clock(void)
+{
+#if defined(_WIN32)
+    LARGE_INTEGER freq, count;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&count);
+    return (uint64_t)(count.QuadPart / freq.QuadPart) * 1000000
+        + (uint64_t)(count.QuadPart % freq.QuadPart) * 1000000 / freq.QuadPart;
+#elif defined(__unix__)
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
 // error(3) impl.
 void z_error(int status, int errnum, const char* fmt, ...)
 {
@@ -44,6 +44,7 @@ ssize_t z_strscpy(char* dst, const char* src, size_t n);
 char* z_stpecpy(char* dst, char* end, const char* src);
 int z_strerror_r(int errnum, char* buf, size_t n);
 void z_delay(uint32_t ms);
+uint64_t z_clock(void);
 void z_error(int status, int errnum, const char* fmt, ...);
 void z_warnx(const char* fmt, ...);
 void z__warnx(const char* fmt, ...);
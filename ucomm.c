@@ -5,22 +5,48 @@
 // https://github.com/matveyt/ucomm
 //
 
+#if defined(__unix__) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
 #include "ucomm.h"
 
 #if defined(_WIN32)
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
 #elif defined(__unix__)
+#include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
+#include <sys/stat.h>
+#if defined(__linux__)
+#include <stdio.h>
+#include <linux/serial.h>
+#include <sys/sysmacros.h>
+#endif // __linux__
 #if !defined(O_CLOEXEC)
 #define O_CLOEXEC 0
 #endif // O_CLOEXEC
 #if !defined(TIOCINQ)
 #define TIOCINQ FIONREAD
 #endif // TIOCINQ
+#if defined(__linux__) && defined(TCGETS2) && (defined(__i386__) \
+    || defined(__x86_64__) || defined(__arm__) || defined(__aarch64__) \
+    || defined(__riscv))
+// arbitrary baud rate (<asm/termbits.h> conflicts with <termios.h>)
+#define UCOMM_CBAUD     0x100f
+#define UCOMM_BOTHER    0x1000
+#define UCOMM_IBSHIFT   16
+struct termios2 {
+    tcflag_t c_iflag, c_oflag, c_cflag, c_lflag;
+    cc_t c_line;
+    cc_t c_cc[19];
+    speed_t c_ispeed, c_ospeed;
+};
+#endif // TCGETS2
 #endif
 
 intptr_t ucomm_open(const char* port, unsigned baud, unsigned config)
@@ -64,23 +90,33 @@ int ucomm_close(intptr_t fd)
 #endif
 }
 
-static unsigned baudrate(unsigned baud)
+// get nearest supported rate (also its value in bps)
+static unsigned baudrate(unsigned baud, unsigned* bps)
 {
 #if defined(_WIN32)
-    return baud ? baud : 115200;
+    return *bps = baud ? baud : 115200;
 #elif defined(__unix__)
     static const unsigned ubr[] = {
 #define B(n)    (B##n), (n),
         B(50) B(75) B(110) B(134) B(150) B(200) B(300) B(600) B(1200) B(1800) B(2400)
         B(4800) B(9600) B(19200) B(38400) B(57600) B(115200) /*B(128000)*/ B(230400)
-        /*B(256000)*/ B(460800) /*B(500000)*/ /*B(576000)*/ B(921600) /*B(1000000)*/
-        /*B(1152000)*/ /*B(1500000)*/ /*B(2000000)*/ /*B(2500000)*/ /*B(3000000)*/
-        /*B(3500000)*/ /*B(4000000)*/
+        /*B(256000)*/ B(460800)
+#if defined(B500000)
+        B(500000) B(576000)
+#endif
+        B(921600)
+#if defined(B1000000)
+        B(1000000) B(1152000) B(1500000) B(2000000) B(2500000) B(3000000)
+        B(3500000) B(4000000)
+#endif
 #undef B
     };
     for (ssize_t i = sizeof(ubr) / sizeof(ubr[0]) - 1; i > 0; i -= 2)
-        if (baud >= ubr[i])
+        if (baud >= ubr[i]) {
+            *bps = ubr[i];
             return ubr[i - 1];
+        }
+    *bps = 115200;
     return B115200;
 #endif
 }
@@ -102,7 +138,7 @@ int ucomm_reset(intptr_t fd, unsigned baud, unsigned config)
 #if defined(_WIN32)
     DCB dcb = {
         .DCBlength = sizeof(DCB),
-        .BaudRate = baudrate(baud),
+        .BaudRate = baudrate(baud, &(unsigned){0}),
         .fBinary = 1,
         .fParity = !!parity,
         .fDtrControl = DTR_CONTROL_DISABLE,
@@ -138,10 +174,24 @@ int ucomm_reset(intptr_t fd, unsigned baud, unsigned config)
     }
     tio.c_cflag |= (stopbits == 2) ? CSTOPB : 0;
     tio.c_cflag |= (CREAD | CLOCAL);
-    speed_t ubr = baudrate(baud);
+    unsigned bps;
+    speed_t ubr = baudrate(baud, &bps);
     cfsetispeed(&tio, ubr);
     cfsetospeed(&tio, ubr);
-    return tcsetattr(fd, TCSAFLUSH, &tio);
+    int result = tcsetattr(fd, TCSAFLUSH, &tio);
+#if defined(UCOMM_BOTHER)
+    // not in the table, ask driver for exact rate
+    if (result == 0 && baud > 0 && baud != bps) {
+        struct termios2 tio2;
+        if (ioctl(fd, TCGETS2, &tio2) == 0) {
+            tio2.c_cflag &= ~(UCOMM_CBAUD | (UCOMM_CBAUD << UCOMM_IBSHIFT));
+            tio2.c_cflag |= UCOMM_BOTHER | (UCOMM_BOTHER << UCOMM_IBSHIFT);
+            tio2.c_ispeed = tio2.c_ospeed = baud;
+            result = ioctl(fd, TCSETS2, &tio2);
+        }
+    }
+#endif // UCOMM_BOTHER
+    return result;
 #endif
 }
 
@@ -174,6 +224,24 @@ int ucomm_timeout(intptr_t fd, unsigned ms)
 #endif
 }
 
+int ucomm_frame(intptr_t fd, unsigned n)
+{
+    if (n == 0)
+        return ucomm_timeout(fd, UCOMM_DEFAULT_TIMEOUT);
+#if defined(_WIN32)
+    // ReadFile() waits for the full buffer anyway
+    (void)fd;
+    return 0;
+#elif defined(__unix__)
+    // poll() and read() won't wake up until VMIN bytes are in (unless VTIME > 0)
+    struct termios tio;
+    tcgetattr(fd, &tio);
+    tio.c_cc[VMIN] = (cc_t)((n < 255) ? n : 255);
+    tio.c_cc[VTIME] = 0;
+    return tcsetattr(fd, TCSANOW, &tio);
+#endif
+}
+
 int ucomm_dtr(intptr_t fd, int pulldown)
 {
 #if defined(_WIN32)
@@ -194,6 +262,83 @@ int ucomm_rts(intptr_t fd, int pulldown)
 #endif
 }
 
+int ucomm_modem(intptr_t fd, int dtr, int rts)
+{
+#if defined(_WIN32)
+    // no way to do it atomically
+    return (ucomm_dtr(fd, dtr) == 0 && ucomm_rts(fd, rts) == 0) ? 0 : -1;
+#elif defined(__unix__)
+    int lines;
+    if (ioctl(fd, TIOCMGET, &lines) < 0)
+        return -1;
+    lines &= ~(TIOCM_DTR | TIOCM_RTS);
+    lines |= (dtr ? TIOCM_DTR : 0) | (rts ? TIOCM_RTS : 0);
+    return ioctl(fd, TIOCMSET, &lines);
+#endif
+}
+
+#if defined(__linux__)
+// /sys/dev/char/M:m/device/latency_timer (ftdi_sio et al.)
+static int latency_timer(intptr_t fd, int ms)
+{
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISCHR(st.st_mode))
+        return -1;
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/dev/char/%u:%u/device/latency_timer",
+        major(st.st_rdev), minor(st.st_rdev));
+
+    int prev = -1;
+    FILE* f = fopen(path, "r");
+    if (f != NULL) {
+        if (fscanf(f, "%d", &prev) != 1)
+            prev = -1;
+        fclose(f);
+    }
+    if (prev >= 0 && ms > 0 && ms != prev) {
+        f = fopen(path, "w");
+        if (f == NULL)
+            return -1;
+        fprintf(f, "%d", ms);
+        if (fclose(f) != 0)
+            return -1;
+    }
+    return prev;
+}
+#endif // __linux__
+
+int ucomm_latency(intptr_t fd, unsigned ms)
+{
+#if defined(__linux__)
+    return latency_timer(fd, ms);
+#else
+    (void)fd;
+    (void)ms;
+    return -1;
+#endif
+}
+
+int ucomm_low_latency(intptr_t fd, int on)
+{
+#if defined(__linux__)
+    struct serial_struct ss;
+    if (ioctl(fd, TIOCGSERIAL, &ss) < 0)
+        return -1;
+    int flags = ss.flags;
+    if (on)
+        ss.flags |= ASYNC_LOW_LATENCY;
+    else
+        ss.flags &= ~ASYNC_LOW_LATENCY;
+    if (ss.flags != flags && ioctl(fd, TIOCSSERIAL, &ss) < 0)
+        return -1;
+    return (flags & ASYNC_LOW_LATENCY) ? 1 : 0;
+#else
+    (void)fd;
+    (void)on;
+    return -1;
+#endif
+}
+
 ssize_t ucomm_available(intptr_t fd)
 {
 #if defined(_WIN32)
@@ -249,6 +394,71 @@ ssize_t ucomm_read(intptr_t fd, void* buffer, size_t length)
     return sz;
 }
 
+uint64_t ucomm_clock(void)
+{
+#if defined(_WIN32)
+    LARGE_INTEGER freq, count;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&count);
+    return (uint64_t)(count.QuadPart / freq.QuadPart) * 1000000
+        + (uint64_t)(count.QuadPart % freq.QuadPart) * 1000000 / freq.QuadPart;
+#elif defined(__unix__)
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+ssize_t ucomm_read_until(intptr_t fd, void* buffer, size_t length, uint64_t deadline)
+{
+    ssize_t sz = 0;
+#if defined(_WIN32)
+    COMMTIMEOUTS saved;
+    if (!GetCommTimeouts((HANDLE)fd, &saved))
+        return -1;
+#endif
+
+    while (sz < (ssize_t)length) {
+        uint64_t now = ucomm_clock();
+        if (now >= deadline)
+            break;
+        // round up to milliseconds
+        unsigned ms = (unsigned)((deadline - now + 999) / 1000);
+#if defined(_WIN32)
+        // total timeout for the rest of buffer
+        COMMTIMEOUTS timeouts = {
+            .ReadIntervalTimeout = 0,
+            .ReadTotalTimeoutMultiplier = 0,
+            .ReadTotalTimeoutConstant = ms,
+        };
+        DWORD part;
+        BOOL ok = SetCommTimeouts((HANDLE)fd, &timeouts)
+            && ReadFile((HANDLE)fd, (uint8_t*)buffer + sz, length - sz, &part, NULL);
+#elif defined(__unix__)
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        int ready = poll(&pfd, 1, (int)ms);
+        if (ready == 0)
+            break;
+        if (ready < 0 && errno == EINTR)
+            continue;
+        ssize_t part = (ready > 0) ? read(fd, (uint8_t*)buffer + sz, length - sz) : -1;
+        int ok = (part >= 0);
+#endif
+        if (!ok && sz <= 0) {
+            sz = -1;
+            break;
+        }
+        if (part <= 0)
+            break;
+        sz += part;
+    }
+
+#if defined(_WIN32)
+    SetCommTimeouts((HANDLE)fd, &saved);
+#endif
+    return sz;
+}
+
 ssize_t ucomm_write(intptr_t fd, const void* buffer, size_t length)
 {
     ssize_t sz = 0;
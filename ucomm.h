@@ -27,6 +27,7 @@ intptr_t ucomm_open(const char* port, unsigned baud, unsigned config);
 int ucomm_close(intptr_t fd);
 
 // reset port configuration (also, discard I/O buffers)
+// note: on __linux__ non-standard baud rates are set exactly (BOTHER)
 int ucomm_reset(intptr_t fd, unsigned baud, unsigned config);
 
 // discard I/O buffers
@@ -36,9 +37,27 @@ int ucomm_purge(intptr_t fd);
 // note: on __unix__ timeout is rounded up to 100 ms
 int ucomm_timeout(intptr_t fd, unsigned ms);
 
+// set framed receive mode: wake up reader after n bytes only (0 to turn off)
+// note: ucomm_timeout() turns it off too, use ucomm_read_until() for deadline
+int ucomm_frame(intptr_t fd, unsigned n);
+
 // set DTR and RTS (Cf. "set" means pulldown)
 int ucomm_dtr(intptr_t fd, int pulldown);
 int ucomm_rts(intptr_t fd, int pulldown);
+// set both at once (TIOCMSET)
+int ucomm_modem(intptr_t fd, int dtr, int rts);
+
+// set USB-serial latency timer (ms, 0 for driver default), return previous or -1
+// note: caller must restore previous value before ucomm_close() as it persists
+int ucomm_latency(intptr_t fd, unsigned ms);
+// int prev = ucomm_latency(fd, 1);
+// ...
+// if (prev >= 0)
+//     ucomm_latency(fd, prev);
+
+// set or clear low latency flag (ASYNC_LOW_LATENCY), return previous (0/1) or -1
+// note: for drivers with no timer, restore likewise
+int ucomm_low_latency(intptr_t fd, int on);
 
 // get number of bytes in the input buffer
 ssize_t ucomm_available(intptr_t fd);
@@ -51,6 +70,15 @@ int ucomm_putc(intptr_t fd, int ch);
 ssize_t ucomm_read(intptr_t fd, void* buffer, size_t length);
 ssize_t ucomm_write(intptr_t fd, const void* buffer, size_t length);
 
+// monotonic clock (microseconds)
+uint64_t ucomm_clock(void);
+
+// read data buffer until complete or deadline (by ucomm_clock) passes
+// note: this is a total timeout, unlike inter-byte one of ucomm_timeout()
+ssize_t ucomm_read_until(intptr_t fd, void* buffer, size_t length, uint64_t deadline);
+// // wait 20 ms at most
+// ucomm_read_until(fd, buffer, 64, ucomm_clock() + 20000);
+
 // get ports list (in ucomm_ports.c)
 size_t ucomm_ports(char*** ports);
 // char** ports;
@@ -63,6 +91,42 @@ size_t ucomm_ports(char*** ports);
 // } else
 //     assert(ports == NULL);
 
+// get ports list with USB details (in ucomm_ports.c)
+// note: all strings are non-NULL, vid and pid are 0 unless USB device
+struct ucomm_port {
+    const char* port;
+    const char* driver;
+    const char* serial;
+    unsigned vid, pid;
+};
+size_t ucomm_ports_info(struct ucomm_port** info);
+// struct ucomm_port* info;
+// size_t n = ucomm_ports_info(&info);
+// for (size_t i = 0; i < n; ++i)
+//     printf("%s %04x:%04x\n", info[i].port, info[i].vid, info[i].pid);
+// assert(info[n].port == NULL);
+// free(info);
+
+// read sysfs attribute of port or its parent devices (in ucomm_ports.c, unix only)
+// note: symlinks such as "driver" are read as their target name
+ssize_t ucomm_port_attr(const char* port, const char* attr, char* value, size_t sz);
+// char vid[8];
+// ucomm_port_attr("/dev/ttyUSB0", "idVendor", vid, sizeof(vid));
+
+// watch for new ports (in ucomm_ports.c, Linux only)
+intptr_t ucomm_watch_open(void);
+// wait for ports to appear, return their number (argv[] style as ucomm_ports)
+// note: deadline of 0 means wait forever
+ssize_t ucomm_watch(intptr_t wd, char*** ports, uint64_t deadline);
+int ucomm_watch_close(intptr_t wd);
+// intptr_t wd = ucomm_watch_open();
+// char** ports;
+// while (ucomm_watch(wd, &ports, 0) > 0) {
+//     start(ports[0]);
+//     free(ports);
+// }
+// ucomm_watch_close(wd);
+
 #if defined(__cplusplus)
 }
 #endif
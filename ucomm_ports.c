@@ -5,7 +5,11 @@
 // https://github.com/matveyt/ucomm
 //
 
+#if defined(__unix__) && !defined(_XOPEN_SOURCE)
+#define _XOPEN_SOURCE 700   // realpath()
+#endif
 #include "ucomm.h"
+#include <errno.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -14,9 +18,31 @@
 #include <windows.h>
 #elif defined(__unix__)
 #include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <unistd.h>
+#include <sys/stat.h>
+#if defined(__linux__)
+#include <poll.h>
+#include <sys/inotify.h>
+#endif // __linux__
+#if !defined(O_CLOEXEC)
+#define O_CLOEXEC 0
+#endif // O_CLOEXEC
 #endif
 
+#if !defined(NAME_MAX)
+#define NAME_MAX 255
+#endif // NAME_MAX
+
+// port found by scan
+typedef struct {
+    char port[sizeof("/dev/") + NAME_MAX];
+    char driver[64];
+    char serial[128];
+    unsigned vid, pid;
+} ENTRY;
+
 #if defined(__unix__)
 // strntest("Hello!", "AZaz", 5) => 0
 // strntest("Hello!", "AZaz", 6) => -1
@@ -34,7 +60,165 @@ static int strntest(const char* str, const char* test, size_t n)
     }
     return 0;
 }
-#endif
+
+// sysfs tty class, UCOMM_SYSFS overrides (for testing)
+static int open_sysfs(void)
+{
+    const char* root = getenv("UCOMM_SYSFS");
+    return open((root != NULL && *root != '\0') ? root : "/sys/class/tty",
+        O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+}
+
+// tty[0-9]*, tty[p-za-e][0-9a-f], pty* etc. never have a device
+static int is_virtual(const char* name)
+{
+    if (strncmp(name, "pty", 3) == 0)
+        return 1;
+    if (strncmp(name, "tty", 3) != 0)
+        return (strcmp(name, "console") == 0 || strcmp(name, "ptmx") == 0);
+    name += 3;
+    return (name[0] == '\0' || (name[0] >= '0' && name[0] <= '9')
+        || (strlen(name) == 2 && strntest(name, "pzae", 1) == 0
+            && strntest(&name[1], "09af", 1) == 0));
+}
+
+// test if /dev/name is a serial port (dfd is sysfs tty class or -1)
+static int is_port(int dfd, const char* name)
+{
+    size_t len = strlen(name);
+    if (dfd >= 0) {
+        // test if name/device exists without building full path
+        char device[NAME_MAX + sizeof("/device")];
+        struct stat st;
+        if (len > NAME_MAX || is_virtual(name))
+            return 0;
+        memcpy(device, name, len);
+        memcpy(&device[len], "/device", sizeof("/device"));
+        return (fstatat(dfd, device, &st, AT_SYMLINK_NOFOLLOW) == 0);
+    } else if (len >= sizeof("ttyS0") - 1) {
+        // /dev/tty[A-Z][0-9A-Z]+
+        if (strncmp(name, "tty", 3) == 0)
+            return (strntest(&name[3], "AZ", 1) == 0
+                && strntest(&name[4], "09AZ", 0) == 0);
+        // /dev/cua[Udu][0-9]+ (BSD)
+        else if (strncmp(name, "cua", 3) == 0)
+            return (strchr("Udu", name[3]) != NULL
+                && strntest(&name[4], "09", 0) == 0);
+    }
+    return 0;
+}
+
+// read sysfs attribute, symlink (driver, subsystem) as its target name
+static ssize_t read_attr(int fd, const char* attr, char* value, size_t sz)
+{
+    char link[PATH_MAX];
+    ssize_t len = readlinkat(fd, attr, link, sizeof(link) - 1);
+    if (len >= 0) {
+        link[len] = '\0';
+        const char* base = strrchr(link, '/') ? strrchr(link, '/') + 1 : link;
+        len = strlen(base);
+        len = ((size_t)len < sz) ? len : (ssize_t)sz - 1;
+        memcpy(value, base, len);
+    } else {
+        int afd = openat(fd, attr, O_RDONLY | O_CLOEXEC);
+        if (afd < 0)
+            return -1;
+        len = read(afd, value, sz - 1);
+        close(afd);
+        if (len < 0)
+            return -1;
+        while (len > 0 && (value[len - 1] == '\n' || value[len - 1] == ' '))
+            --len;
+    }
+    value[len] = '\0';
+    return len;
+}
+
+// walk from name/device up to interface, USB device etc. while they are devices
+// call fn(fd, ctx) at each level until it returns nonzero
+static int walk_device(int dfd, const char* name, int (*fn)(int fd, void* ctx),
+    void* ctx)
+{
+    char device[NAME_MAX + sizeof("/device")];
+    size_t len = strlen(name);
+    if (len > NAME_MAX)
+        return 0;
+    memcpy(device, name, len);
+    memcpy(&device[len], "/device", sizeof("/device"));
+
+    int rc = 0;
+    int fd = openat(dfd, device, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    for (int level = 0; fd >= 0 && level < 8; ++level) {
+        if ((rc = fn(fd, ctx)) != 0)
+            break;
+        // ".." of resolved directory, not of symlink
+        int parent = openat(fd, "..", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        close(fd);
+        struct stat st;
+        fd = (parent >= 0 && fstatat(parent, "uevent", &st, 0) == 0) ? parent : -1;
+        if (fd < 0 && parent >= 0)
+            close(parent);
+    }
+    if (fd >= 0)
+        close(fd);
+    return rc;
+}
+
+// first driver, then VID:PID and serial of USB device
+static int get_info(int fd, void* ctx)
+{
+    ENTRY* e = (ENTRY*)ctx;
+    char hex[8];
+    if (e->driver[0] == '\0')
+        read_attr(fd, "driver", e->driver, sizeof(e->driver));
+    if (read_attr(fd, "idVendor", hex, sizeof(hex)) <= 0)
+        return 0;
+    e->vid = strtoul(hex, NULL, 16);
+    if (read_attr(fd, "idProduct", hex, sizeof(hex)) > 0)
+        e->pid = strtoul(hex, NULL, 16);
+    read_attr(fd, "serial", e->serial, sizeof(e->serial));
+    return 1;
+}
+
+// scan sysfs (or /dev as fallback), get details if requested
+static size_t scan_ports(ENTRY** entries, int info)
+{
+    ENTRY* result = NULL;
+    size_t n = 0, max = 0;
+
+    int dfd = open_sysfs();
+    DIR* dir = (dfd >= 0) ? fdopendir(dfd) : opendir("/dev/");
+    if (dir == NULL && dfd >= 0)
+        close(dfd);
+
+    if (dir != NULL) {
+        struct dirent* entry;
+        while ((entry = readdir(dir)) != NULL) {
+            if (!is_port(dfd, entry->d_name))
+                continue;
+            // grow twice
+            if (n == max) {
+                size_t grow = max ? 2 * max : 16;
+                ENTRY* more = (ENTRY*)realloc(result, grow * sizeof(ENTRY));
+                if (more == NULL)
+                    break;
+                result = more;
+                max = grow;
+            }
+            ENTRY* e = &result[n++];
+            memset(e, 0, sizeof(ENTRY));
+            strcpy(e->port, "/dev/");
+            strcat(e->port, entry->d_name);
+            if (info && dfd >= 0)
+                walk_device(dfd, entry->d_name, get_info, e);
+        }
+        closedir(dir);
+    }
+
+    *entries = result;
+    return n;
+}
+#endif // __unix__
 
 size_t ucomm_ports(char*** ports)
 {
@@ -77,81 +261,21 @@ size_t ucomm_ports(char*** ports)
     if (hKey != NULL)
         RegCloseKey(hKey);
 #elif defined(__unix__)
-    // try sysfs, fallback to scanning /dev
-    DIR* dir = opendir("/sys/class/tty/");
-    int sysfs = (dir != NULL);
-    if (!sysfs)
-        dir = opendir("/dev/");
+    ENTRY* entries;
+    n = scan_ports(&entries, 0);
 
-    if (dir != NULL) {
-        struct dirent* entry;
-        while ((entry = readdir(dir)) != NULL) {
-            int match = 0;
-            size_t entry_len = strlen(entry->d_name);
-
-            if (sysfs) {
-                // test if /sys/class/tty/d_name/device exists
-                char device[sizeof("/sys/class/tty/") - 1 + sizeof(entry->d_name)
-                    + sizeof("/device") - 1];
-                strcpy(device, "/sys/class/tty/");
-                strcat(device, entry->d_name);
-                strcat(device, "/device");
-                match = (access(device, F_OK) == 0);
-            } else if (entry_len >= sizeof("ttyS0") - 1
-                /*&& entry->d_type == DT_CHR*/) {
-                // /dev/tty[A-Z][0-9A-Z]+
-                if (strncmp(entry->d_name, "tty", 3) == 0)
-                    match = (strntest(&entry->d_name[3], "AZ", 1) == 0
-                        && strntest(&entry->d_name[4], "09AZ", 0) == 0);
-                // /dev/cua[Udu][0-9]+ (BSD)
-                else if (strncmp(entry->d_name, "cua", 3) == 0)
-                    match = (strchr("Udu", entry->d_name[3]) != NULL
-                        && strntest(&entry->d_name[4], "09", 0) == 0);
-            }
-
-            if (match) {
-                char* value = (char*)result;
-                // grow buffer if needed
-                if (offset + sizeof("/dev/") + entry_len > sz) {
-                    value = (char*)realloc(value, sz + 1024);
-                    if (value == NULL)
-                        break;
-                    result = (char**)value;
-                    sz += 1024;
-                }
-                // append port
-                strcpy(value + offset, "/dev/");
-                strcat(value + offset, entry->d_name);
-                offset += sizeof("/dev/") + entry_len;
-                ++n;
-            }
-        }
-        closedir(dir);
+    // (n + 1) pointers and n strings (Cf. argv[])
+    offset = (n + 1) * sizeof(char*);
+    sz = offset;
+    for (size_t i = 0; i < n; ++i)
+        sz += strlen(entries[i].port) + 1;
+    if (n > 0 && (result = (char**)malloc(sz)) == NULL)
+        n = 0;
+    for (size_t i = 0; i < n; ++i) {
+        result[i] = strcpy((char*)result + offset, entries[i].port);
+        offset += strlen(entries[i].port) + 1;
     }
-
-    if (n > 0) do {
-        // prepend array of (n + 1) pointers
-        char* value = (char*)result;
-        size_t extra = (n + 1) * sizeof(char*);
-        // grow buffer if needed
-        if (extra + offset > sz) {
-            value = (char*)realloc(value, extra + offset);
-            if (value == NULL) {
-                n = 0;
-                break;
-            }
-            result = (char**)value;
-            sz = extra + offset;
-        }
-        // make room for (n + 1) pointers
-        memmove(value + extra, value, offset);
-        offset = extra;
-        // store n pointers
-        for (size_t i = 0; i < n; ++i) {
-            result[i] = value + offset;
-            offset += strlen(value + offset) + 1;
-        }
-    } while (0);
+    free(entries);
 #endif
 
     if (n > 0) {
@@ -165,3 +289,259 @@ size_t ucomm_ports(char*** ports)
     *ports = NULL;
     return 0;
 }
+
+size_t ucomm_ports_info(struct ucomm_port** info)
+{
+    ENTRY* entries;
+#if defined(__unix__)
+    size_t n = scan_ports(&entries, 1);
+#else
+    // port names only
+    char** ports;
+    size_t n = ucomm_ports(&ports);
+    entries = (ENTRY*)calloc(n ? n : 1, sizeof(ENTRY));
+    if (entries == NULL)
+        n = 0;
+    for (size_t i = 0; i < n; ++i)
+        strncpy(entries[i].port, ports[i], sizeof(entries[i].port) - 1);
+    free(ports);
+#endif
+
+    // (n + 1) structs and their strings
+    size_t sz = (n + 1) * sizeof(struct ucomm_port);
+    for (size_t i = 0; i < n; ++i)
+        sz += strlen(entries[i].port) + strlen(entries[i].driver)
+            + strlen(entries[i].serial) + 3;
+    struct ucomm_port* result = (n > 0) ? (struct ucomm_port*)malloc(sz) : NULL;
+    if (result == NULL)
+        n = 0;
+
+    if (n > 0) {
+        char* value = (char*)&result[n + 1];
+        for (size_t i = 0; i < n; ++i) {
+            const ENTRY* e = &entries[i];
+            result[i].port = strcpy(value, e->port);
+            value += strlen(value) + 1;
+            result[i].driver = strcpy(value, e->driver);
+            value += strlen(value) + 1;
+            result[i].serial = strcpy(value, e->serial);
+            value += strlen(value) + 1;
+            result[i].vid = e->vid;
+            result[i].pid = e->pid;
+        }
+        memset(&result[n], 0, sizeof(struct ucomm_port));
+    }
+    free(entries);
+
+    *info = result;
+    return n;
+}
+
+#if defined(__unix__)
+// ucomm_port_attr() at each level
+typedef struct {
+    const char* attr;
+    char* value;
+    size_t sz;
+    ssize_t len;
+} ATTR;
+
+static int get_attr(int fd, void* ctx)
+{
+    ATTR* a = (ATTR*)ctx;
+    a->len = read_attr(fd, a->attr, a->value, a->sz);
+    return (a->len >= 0);
+}
+#endif // __unix__
+
+ssize_t ucomm_port_attr(const char* port, const char* attr, char* value, size_t sz)
+{
+#if defined(__unix__)
+    // /dev/serial/by-id/... => /dev/ttyUSB0 => ttyUSB0
+    char path[PATH_MAX];
+    const char* name = (realpath(port, path) != NULL) ? path : port;
+    name = strrchr(name, '/') ? strrchr(name, '/') + 1 : name;
+    if (sz == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    ATTR a = { .attr = attr, .value = value, .sz = sz, .len = -1 };
+    int dfd = open_sysfs();
+    if (dfd >= 0) {
+        walk_device(dfd, name, get_attr, &a);
+        close(dfd);
+    }
+    if (a.len < 0)
+        errno = ENOENT;
+    return a.len;
+#else
+    (void)port;
+    (void)attr;
+    (void)value;
+    (void)sz;
+    errno = ENOSYS;
+    return -1;
+#endif // __unix__
+}
+
+#if defined(__linux__)
+// inotify on /dev and ports seen there
+struct ucomm_watch {
+    int fd;
+    int sysfs;              // tty class or -1
+    char** known;
+    size_t nknown;
+};
+
+static ssize_t find_known(const struct ucomm_watch* w, const char* port)
+{
+    for (size_t i = 0; i < w->nknown; ++i)
+        if (strcmp(w->known[i], port) == 0)
+            return i;
+    return -1;
+}
+
+static int add_known(struct ucomm_watch* w, const char* port)
+{
+    char** known = (char**)realloc(w->known, (w->nknown + 1) * sizeof(char*));
+    if (known == NULL)
+        return -1;
+    w->known = known;
+    if ((known[w->nknown] = strdup(port)) == NULL)
+        return -1;
+    ++w->nknown;
+    return 0;
+}
+#endif // __linux__
+
+intptr_t ucomm_watch_open(void)
+{
+#if defined(__linux__)
+    struct ucomm_watch* w = (struct ucomm_watch*)calloc(1, sizeof(struct ucomm_watch));
+    if (w == NULL)
+        return -1;
+    w->sysfs = open_sysfs();
+    w->fd = inotify_init1(IN_CLOEXEC);
+    if (w->fd < 0 || inotify_add_watch(w->fd, "/dev",
+            IN_CREATE | IN_ATTRIB | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM) < 0) {
+        ucomm_watch_close((intptr_t)w);
+        return -1;
+    }
+
+    // present ports are not new
+    char** ports;
+    size_t n = ucomm_ports(&ports);
+    for (size_t i = 0; i < n; ++i)
+        add_known(w, ports[i]);
+    free(ports);
+    return (intptr_t)w;
+#else
+    errno = ENOSYS;
+    return -1;
+#endif // __linux__
+}
+
+ssize_t ucomm_watch(intptr_t wd, char*** ports, uint64_t deadline)
+{
+    *ports = NULL;
+#if defined(__linux__)
+    struct ucomm_watch* w = (struct ucomm_watch*)wd;
+    size_t first = w->nknown, n = 0;
+
+    while (n == 0) {
+        int ms = -1;
+        if (deadline != 0) {
+            uint64_t now = ucomm_clock();
+            if (now >= deadline) {
+                errno = ETIMEDOUT;
+                return -1;
+            }
+            ms = (int)((deadline - now + 999) / 1000);
+        }
+        struct pollfd pfd = { .fd = w->fd, .events = POLLIN };
+        int rc = poll(&pfd, 1, ms);
+        if (rc < 0 && errno != EINTR)
+            return -1;
+        if (rc <= 0)
+            continue;
+
+        union {
+            struct inotify_event event;
+            char raw[4096];
+        } buf;
+        ssize_t len = read(w->fd, buf.raw, sizeof(buf.raw));
+        if (len < 0 && errno != EINTR)
+            return -1;
+
+        for (ssize_t i = 0; i < len; ) {
+            const struct inotify_event* ev = (const struct inotify_event*)&buf.raw[i];
+            i += sizeof(struct inotify_event) + ev->len;
+            if (ev->len == 0 || !is_port(w->sysfs, ev->name))
+                continue;
+
+            char port[sizeof("/dev/") + NAME_MAX];
+            strcpy(port, "/dev/");
+            strncat(port, ev->name, NAME_MAX);
+            ssize_t k = find_known(w, port);
+            if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                if (k >= 0) {
+                    // keep order as new ones are at the end
+                    free(w->known[k]);
+                    memmove(&w->known[k], &w->known[k + 1],
+                        (w->nknown - k - 1) * sizeof(char*));
+                    --w->nknown;
+                    first -= ((size_t)k < first);
+                }
+            } else if (k < 0 && access(port, R_OK | W_OK) == 0) {
+                // udev may not have set permissions at IN_CREATE yet
+                if (add_known(w, port) < 0)
+                    return -1;
+            }
+        }
+        n = w->nknown - first;
+    }
+
+    // argv[] style, as ucomm_ports()
+    size_t sz = (n + 1) * sizeof(char*);
+    for (size_t i = 0; i < n; ++i)
+        sz += strlen(w->known[first + i]) + 1;
+    char** result = (char**)malloc(sz);
+    if (result == NULL)
+        return -1;
+    char* value = (char*)&result[n + 1];
+    for (size_t i = 0; i < n; ++i) {
+        result[i] = strcpy(value, w->known[first + i]);
+        value += strlen(value) + 1;
+    }
+    result[n] = NULL;
+    *ports = result;
+    return n;
+#else
+    (void)wd;
+    (void)deadline;
+    errno = ENOSYS;
+    return -1;
+#endif // __linux__
+}
+
+int ucomm_watch_close(intptr_t wd)
+{
+#if defined(__linux__)
+    struct ucomm_watch* w = (struct ucomm_watch*)wd;
+    if (w == NULL)
+        return -1;
+    int rc = (w->fd >= 0) ? close(w->fd) : 0;
+    if (w->sysfs >= 0)
+        close(w->sysfs);
+    for (size_t i = 0; i < w->nknown; ++i)
+        free(w->known[i]);
+    free(w->known);
+    free(w);
+    return rc;
+#else
+    (void)wd;
+    errno = ENOSYS;
+    return -1;
+#endif // __linux__
+}